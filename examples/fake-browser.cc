@@ -0,0 +1,97 @@
+// This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
+// Stand-in browser for webhead-bench, installed as chromium, google-chrome, firefox or epiphany-browser.
+// Environment: FAKE_BROWSER_FETCH=1 requests the app URL once, FAKE_BROWSER_VERSION overrides the version,
+// FAKE_BROWSER_EXIT=<code> exits with <code> after startup instead of waiting for a signal.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+/// Fetch an http:// `url` and discard the response, returns false on errors.
+static bool
+http_fetch (std::string url)
+{
+  if (url.compare (0, 7, "http://") != 0)
+    return false;
+  url = url.substr (0, url.find ('#'));
+  const size_t slash = url.find ('/', 7);
+  const std::string hostport = url.substr (7, slash - 7), path = slash == std::string::npos ? "/" : url.substr (slash);
+  const size_t colon = hostport.rfind (':');
+  const std::string host = hostport.substr (0, colon), port = colon == std::string::npos ? "80" : hostport.substr (colon + 1);
+  struct addrinfo hints = {}, *res = nullptr;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host.c_str(), port.c_str(), &hints, &res) != 0)
+    return false;
+  const int fd = socket (res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const bool connected = fd >= 0 && connect (fd, res->ai_addr, res->ai_addrlen) == 0;
+  freeaddrinfo (res);
+  const std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + hostport + "\r\nConnection: close\r\n\r\n";
+  bool ok = connected && write (fd, request.data(), request.size()) == ssize_t (request.size());
+  char buffer[16384];
+  ssize_t n = 0;
+  while (ok && (n = read (fd, buffer, sizeof (buffer))) > 0) {}
+  if (fd >= 0) close (fd);
+  return ok && n == 0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  const char *slash = strrchr (argv[0], '/');
+  const std::string name = slash ? slash + 1 : argv[0];
+  const char *version = getenv ("FAKE_BROWSER_VERSION");
+  std::string profile, url;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--version") {
+      if (name.find ("firefox") != std::string::npos)
+        printf ("Mozilla Firefox %s\n", version ? version : "128.0.3");
+      else if (name.find ("epiphany") != std::string::npos)
+        printf ("Web %s\n", version ? version : "46.5");
+      else if (name.find ("google-chrome") != std::string::npos)
+        printf ("Google Chrome %s \n", version ? version : "127.0.6533.88");
+      else
+        printf ("Chromium %s \n", version ? version : "127.0.6533.88");
+      return 0;
+    }
+    else if (arg.compare (0, 16, "--user-data-dir=") == 0)
+      profile = arg.substr (16);
+    else if (arg == "--profile" && i + 1 < argc)
+      profile = argv[++i];
+    else if (arg.compare (0, 6, "--app=") == 0)
+      url = arg.substr (6);
+    else if (arg.compare (0, 1, "-") != 0 && arg.find ("://") != std::string::npos)
+      url = arg;
+  }
+  // block termination signals before announcing the start, so none gets lost
+  sigset_t signals;
+  sigemptyset (&signals);
+  for (int sig : { SIGTERM, SIGINT, SIGHUP })
+    sigaddset (&signals, sig);
+  sigprocmask (SIG_BLOCK, &signals, nullptr);
+  // leave a trace in the profile, like a real browser would
+  if (!profile.empty()) {
+    const std::string marker = profile + "/FakeBrowser.pid";
+    const int fd = open (marker.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      dprintf (fd, "%d\n", getpid());
+      close (fd);
+    }
+  }
+  fprintf (stderr, "%s: started: pid=%d profile=%s url=%s\n", name.c_str(), getpid(), profile.c_str(), url.c_str());
+  const char *fetch = getenv ("FAKE_BROWSER_FETCH");
+  if (fetch && atoi (fetch) && !http_fetch (url))
+    fprintf (stderr, "%s: failed to fetch: %s\n", name.c_str(), url.c_str());
+  if (const char *exit_code = getenv ("FAKE_BROWSER_EXIT"))
+    return atoi (exit_code);
+  int sig = 0;
+  sigwait (&signals, &sig);
+  fprintf (stderr, "%s: exiting on signal %d\n", name.c_str(), sig);
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Generated by webhead-bundle.py from frontend, do not edit
+#pragma once
+#include "../src/webhead.hh"
+
+namespace WebHeadBundle_frontend {
+alignas (16) inline constexpr unsigned char f0_identity[] = {
+  60,33,68,79,67,84,89,80,69,32,104,116,109,108,62,10,60,104,116,109,108,62,10,60,104,101,97,100,62,10,32,32,
+  60,109,101,116,97,32,99,104,97,114,115,101,116,61,34,117,116,102,45,56,34,62,10,32,32,60,116,105,116,108,101,62,
+  87,101,98,72,101,97,100,32,66,117,110,100,108,101,60,47,116,105,116,108,101,62,10,32,32,60,108,105,110,107,32,114,
+  101,108,61,34,115,116,121,108,101,115,104,101,101,116,34,32,104,114,101,102,61,34,115,116,121,108,101,46,99,115,115,34,
+  62,10,60,47,104,101,97,100,62,10,60,98,111,100,121,62,10,32,32,60,104,49,62,83,101,114,118,101,100,32,102,114,
+  111,109,32,97,32,87,101,98,72,101,97,100,58,58,66,117,110,100,108,101,60,47,104,49,62,10,32,32,60,112,62,84,
+  104,105,115,32,112,97,103,101,32,119,97,115,32,101,109,98,101,100,100,101,100,32,97,116,32,99,111,109,112,105,108,101,
+  32,116,105,109,101,32,98,121,32,115,114,99,47,119,101,98,104,101,97,100,45,98,117,110,100,108,101,46,112,121,32,97,
+  110,100,32,105,115,32,115,101,114,118,101,100,32,102,114,111,109,32,109,101,109,111,114,121,32,98,121,32,116,104,101,32,
+  72,116,116,112,83,101,114,118,101,114,46,60,47,112,62,10,60,47,98,111,100,121,62,10,60,47,104,116,109,108,62,10
+};
+alignas (16) inline constexpr unsigned char f0_gzip[] = {
+  31,139,8,0,0,0,0,0,2,3,77,144,193,106,195,48,16,68,239,249,138,173,239,177,233,45,4,197,135,54,133,220,
+  26,104,160,244,40,89,227,74,84,178,133,180,105,240,223,87,146,19,232,105,97,119,102,222,176,226,233,248,254,122,249,58,
+  191,145,97,239,250,141,120,12,72,221,111,136,132,7,75,26,140,140,9,124,104,174,60,110,119,77,61,176,101,135,254,19,
+  234,148,165,244,114,157,180,131,232,214,109,185,59,59,253,80,132,59,52,137,23,135,100,0,110,200,68,140,247,77,59,164,
+  148,163,68,183,178,132,154,245,82,157,230,185,255,64,252,133,166,49,206,158,36,221,33,251,253,131,146,21,69,24,250,139,
+  177,137,130,252,6,221,100,34,120,5,173,179,79,50,13,179,15,214,129,216,122,144,90,40,197,161,187,65,21,214,86,213,
+  152,54,44,36,39,77,57,33,253,195,121,248,57,46,197,194,6,116,98,14,181,76,108,69,23,74,219,181,102,238,80,31,
+  245,7,24,17,149,192,64,1,0,0
+};
+alignas (16) inline constexpr unsigned char f1_identity[] = {
+  98,111,100,121,32,123,32,102,111,110,116,45,102,97,109,105,108,121,58,32,115,97,110,115,45,115,101,114,105,102,59,32,
+  109,97,114,103,105,110,58,32,50,101,109,59,32,98,97,99,107,103,114,111,117,110,100,58,32,35,50,50,51,59,32,99,
+  111,108,111,114,58,32,35,101,101,101,59,32,125,10,104,49,32,123,32,102,111,110,116,45,115,105,122,101,58,32,49,46,
+  53,101,109,59,32,125,10,112,32,123,32,109,97,120,45,119,105,100,116,104,58,32,52,48,101,109,59,32,108,105,110,101,
+  45,104,101,105,103,104,116,58,32,49,46,53,59,32,125,10
+};
+inline constexpr WebHead::BundleFile files[] = {
+  { "/index.html", "text/html; charset=utf-8",
+    { f0_identity, 320, "\"ef33fab8325bcd667d66\"" }, { f0_gzip, 234, "\"ef33fab8325bcd667d66-gzip\"" }, {} },
+  { "/style.css", "text/css; charset=utf-8",
+    { f1_identity, 144, "\"261c8f11f6f7ccf885b1\"" }, {}, {} },
+};
+inline constexpr uint32_t seeds[] = { 1 };
+} // WebHeadBundle_frontend
+
+inline constexpr WebHead::Bundle frontend = { "frontend", WebHeadBundle_frontend::files, 2, WebHeadBundle_frontend::seeds, 1 };
@@ -2,6 +2,7 @@
 #include "../src/webhead.cc"
 #include <stdio.h>
 #include <stdint.h>
+#include <poll.h>
 
 using namespace WebHead;
 
@@ -24,9 +25,11 @@ main (int argc, const char *argv[])
     printf ("%s:%s: %s: running=%d: %s\n", __FILE__, __func__, browsers[0].executable.c_str(), wh.running(), strerror (err));
     // Kill web head after some time
     // sleep (5); wh.kill();
-    // Or keep running as long as the web head is running
+    // Or keep running as long as the web head is running, exit_fd() becomes readable once it exits
+    struct pollfd pfd = { wh.exit_fd(), POLLIN, 0 };
     while (wh.running())
-      sleep (1);
+      if (pfd.fd < 0 || poll (&pfd, 1, -1) < 0)
+        sleep (1);
   };
   return 0;
 }
@@ -0,0 +1,181 @@
+// This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
+#include "../src/webhead.cc"
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace WebHead;
+
+/// Minimal blocking WebSocket client, standing in for the web head.
+struct WsClient {
+  int         fd = -1;
+  std::string rx;
+  bool
+  connect_to (int port, const std::string &target)
+  {
+    fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) != 0)
+      return false;
+    const int one = 1;
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    const std::string request = "GET " + target + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    if (write (fd, request.data(), request.size()) != ssize_t (request.size()))
+      return false;
+    while (rx.find ("\r\n\r\n") == std::string::npos)
+      if (!fill())
+        return false;
+    const bool ok = rx.compare (0, 12, "HTTP/1.1 101") == 0 && rx.find ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") != std::string::npos;
+    rx.erase (0, rx.find ("\r\n\r\n") + 4);
+    return ok;
+  }
+  bool
+  fill ()
+  {
+    char buffer[65536];
+    const ssize_t n = read (fd, buffer, sizeof (buffer));
+    if (n <= 0) return false;
+    rx.append (buffer, n);
+    return true;
+  }
+  void
+  send_text (const std::string &payload)
+  {
+    std::string frame;
+    frame += char (0x81);
+    if (payload.size() < 126)
+      frame += char (0x80 | payload.size());
+    else {
+      frame += char (0x80 | 126);
+      frame += char (payload.size() >> 8);
+      frame += char (payload.size());
+    }
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    frame.append ((const char*) mask, 4);
+    for (size_t i = 0; i < payload.size(); i++)
+      frame += char (payload[i] ^ mask[i & 3]);
+    if (write (fd, frame.data(), frame.size()) < 0)
+      perror ("write");
+  }
+  bool
+  recv_frame (std::string &payload)
+  {
+    while (true) {
+      if (rx.size() >= 2) {
+        const uint8_t *h = (const uint8_t*) rx.data();
+        uint64_t length = h[1] & 0x7f;
+        size_t hlen = 2;
+        if (length == 126 && rx.size() >= 4)
+          length = h[2] << 8 | h[3], hlen = 4;
+        else if (length == 127 && rx.size() >= 10) {
+          length = 0;
+          for (size_t i = 0; i < 8; i++)
+            length = length << 8 | h[2 + i];
+          hlen = 10;
+        } else if (length >= 126)
+          length = ~uint64_t (0);
+        if (length != ~uint64_t (0) && rx.size() >= hlen + length) {
+          payload.assign (rx, hlen, length);
+          rx.erase (0, hlen + length);
+          return true;
+        }
+      }
+      if (!fill())
+        return false;
+    }
+  }
+};
+
+/// Count occurrences of `needle` in `haystack`.
+static size_t
+count_substr (const std::string &haystack, const char *needle)
+{
+  size_t n = 0;
+  for (size_t pos = haystack.find (needle); pos != std::string::npos; pos = haystack.find (needle, pos + 1))
+    n++;
+  return n;
+}
+
+/// Send `total` state updates as fast as backpressure allows, returns messages received by the client.
+static size_t
+bench_updates (JsonIpc &ipc, WsClient &client, size_t total, bool keyed, double *seconds)
+{
+  std::mutex mutex;
+  std::condition_variable drained;
+  ipc.on_drain ([&] () { std::lock_guard<std::mutex> lock (mutex); drained.notify_all(); });
+  const auto t0 = std::chrono::steady_clock::now();
+  std::thread producer ([&] () {
+    char msg[128];
+    for (size_t i = 0; i < total; i++) {
+      snprintf (msg, sizeof (msg), "{\"ev\":\"state\",\"seq\":%zu,\"value\":%.3f}", i, i * 0.001);
+      while (!ipc.send (msg, keyed ? "state" : "")) {
+        std::unique_lock<std::mutex> lock (mutex);
+        drained.wait_for (lock, std::chrono::milliseconds (10));
+      }
+    }
+    ipc.send ("{\"ev\":\"done\"}");
+  });
+  size_t received = 0;
+  std::string payload;
+  while (client.recv_frame (payload)) {
+    received += count_substr (payload, "\"seq\"");
+    if (payload.find ("\"done\"") != std::string::npos)
+      break;
+  }
+  producer.join();
+  *seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - t0).count();
+  return received;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  const size_t updates = argc > 1 ? atoll (argv[1]) : 1000000, calls = argc > 2 ? atoll (argv[2]) : 20000;
+  HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions { .docroot = "." });
+  if (int err = server->listen()) {
+    dprintf (2, "%s:%s: failed to listen: %s\n", __FILE__, __func__, strerror (err));
+    return 1;
+  }
+  JsonIpc ipc (server);
+  ipc.on_call ([&ipc] (const JsonIpc::Call &call) {
+    if (call.method == "echo")
+      ipc.reply (call.id, call.params);
+  });
+  WsClient client;
+  if (!client.connect_to (server->port(), ipc.endpoint())) {
+    dprintf (2, "%s:%s: WebSocket handshake failed\n", __FILE__, __func__);
+    return 1;
+  }
+  while (!ipc.connected())
+    usleep (1000);
+  // throughput of individual updates, coalesced per write
+  double seconds = 0;
+  size_t received = bench_updates (ipc, client, updates, false, &seconds);
+  printf ("jsonipc.updates: messages=%zu received=%zu seconds=%.3f messages_per_second=%.0f\n",
+          updates, received, seconds, received / seconds);
+  // keyed updates, intermediate states are dropped when the client falls behind
+  received = bench_updates (ipc, client, updates, true, &seconds);
+  printf ("jsonipc.keyed_updates: messages=%zu received=%zu seconds=%.3f updates_per_second=%.0f\n",
+          updates, received, seconds, updates / seconds);
+  // round trip latency of calls
+  std::vector<double> rtts;
+  std::string payload;
+  for (size_t i = 0; i < calls; i++) {
+    const std::string call = posix_printf ("{\"id\":%zu,\"method\":\"echo\",\"params\":[%zu]}", i, i);
+    const auto t0 = std::chrono::steady_clock::now();
+    client.send_text (call);
+    if (!client.recv_frame (payload))
+      break;
+    rtts.push_back (std::chrono::duration<double, std::micro> (std::chrono::steady_clock::now() - t0).count());
+  }
+  std::sort (rtts.begin(), rtts.end());
+  if (rtts.size())
+    printf ("jsonipc.call_rtt_us: calls=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", rtts.size(),
+            rtts[rtts.size() * 50 / 100], rtts[rtts.size() * 90 / 100], rtts[rtts.size() * 99 / 100], rtts.back());
+  return 0;
+}
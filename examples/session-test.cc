@@ -0,0 +1,250 @@
+// This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
+// Session checks against the stand-in browser, run via `make check`.
+#include "../src/webhead.cc"
+#include "frontend-bundle.hh"
+#include <stdio.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+using namespace WebHead;
+
+static int failures = 0;
+
+#define CHECK(cond, ...)        do { if (!(cond)) { failures++; dprintf (2, "%s:%d: %s: CHECK failed: %s: ", __FILE__, __LINE__, __func__, #cond); \
+                                       dprintf (2, __VA_ARGS__); dprintf (2, "\n"); } } while (0)
+
+/// Poll exit_fd() and call running() like examples/hello.cc, on_exit must still see every exit exactly once.
+static void
+test_exit_fd_running (const BrowserInfo &browser, int iterations)
+{
+  setenv ("FAKE_BROWSER_EXIT", "7", 1);
+  for (int i = 0; i < iterations; i++) {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<int> exits;
+    SessionOptions options;
+    options.background_gc = false;
+    options.on_exit = [&] (int exit_code) {
+      std::lock_guard<std::mutex> lock (mutex);
+      exits.push_back (exit_code);
+      cond.notify_all();
+    };
+    Session session ("about:blank", "session-test", options);
+    const int err = session.start (browser);
+    CHECK (err == 0, "start: %s", strerror (err));
+    struct pollfd pfd = { session.exit_fd(), POLLIN, 0 };
+    CHECK (pfd.fd >= 0, "exit_fd=%d", pfd.fd);
+    while (pfd.fd >= 0 && session.running())
+      poll (&pfd, 1, 5000);
+    CHECK (!session.running(), "web head still running");
+    std::unique_lock<std::mutex> lock (mutex);
+    cond.wait_for (lock, std::chrono::seconds (5), [&] () { return !exits.empty(); });
+    CHECK (exits.size() == 1, "on_exit calls: %zu", exits.size());
+    CHECK (exits.size() && exits[0] == 7, "exit code: %d", exits.size() ? exits[0] : -1);
+    lock.unlock();
+    CHECK (session.stats().exit != 0, "no Exit phase recorded");
+    CHECK (session.stats().exit_code == 7, "stats exit_code: %d", session.stats().exit_code);
+    session.shutdown (1000);
+    std::lock_guard<std::mutex> relock (mutex);
+    CHECK (exits.size() == 1, "on_exit calls after shutdown: %zu", exits.size());
+  }
+  unsetenv ("FAKE_BROWSER_EXIT");
+}
+
+/// Code cache stores must stay under $XDG_CACHE_HOME, also for absolute app names like the default /proc/self/exe path.
+static void
+test_code_cache_appname (const BrowserInfo &browser)
+{
+  const std::string base = cache_home() + "/WebHead/CodeCache/";
+  for (const std::string &appname : { std::string ("/usr/bin/app"), default_appname (""), std::string ("session-test") }) {
+    const CodeCache cache (browser, appname, "/nonexistent");
+    CHECK (cache.store.compare (0, base.size(), base) == 0, "%s: store outside of the cache: %s", appname.c_str(), cache.store.c_str());
+    const size_t slash = cache.store.find ('/', base.size());
+    CHECK (slash != std::string::npos && cache.store.find ('/', slash + 1) == std::string::npos, "%s: misplaced store: %s",
+           appname.c_str(), cache.store.c_str());
+  }
+  CHECK (CodeCache (browser, "/usr/bin/app", "").store != CodeCache (browser, "/opt/bin/app", "").store, "app name collision");
+}
+
+/// Request `path` from the loopback `port`, returns the raw response.
+static std::string
+http_get (int port, const std::string &path, const std::string &headers = "")
+{
+  const int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  std::string response;
+  const std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + headers + "\r\n";
+  if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == 0 && write (fd, request.data(), request.size()) == ssize_t (request.size())) {
+    char buffer[16384];
+    ssize_t n;
+    while ((n = read (fd, buffer, sizeof (buffer))) > 0)
+      response.append (buffer, n);
+  }
+  close (fd);
+  return response;
+}
+
+/// Serve the Bundle generated from frontend/ by src/webhead-bundle.py.
+static void
+test_bundle_serving ()
+{
+  static_assert (frontend.find ("/index.html") != nullptr && frontend.find ("/missing.html") == nullptr);
+  HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions());
+  CHECK (server->listen() == 0, "failed to listen");
+  server->mount (frontend);
+  const BundleFile *index = frontend.find ("/index.html");
+  std::string r = http_get (server->port(), "/");
+  CHECK (r.compare (0, 15, "HTTP/1.1 200 OK") == 0, "GET /: %s", r.substr (0, r.find ('\r')).c_str());
+  CHECK (r.size() >= index->identity.size && r.compare (r.size() - index->identity.size, index->identity.size,
+                                                         (const char*) index->identity.data, index->identity.size) == 0, "GET /: body mismatch");
+  r = http_get (server->port(), "/style.css");
+  CHECK (r.find ("Content-Type: text/css") != std::string::npos, "GET /style.css: wrong type");
+  r = http_get (server->port(), "/index.html", posix_printf ("If-None-Match: %s\r\n", index->identity.etag));
+  CHECK (r.compare (0, 12, "HTTP/1.1 304") == 0, "conditional GET: %s", r.substr (0, r.find ('\r')).c_str());
+  r = http_get (server->port(), "/missing.html");
+  CHECK (r.compare (0, 12, "HTTP/1.1 404") == 0, "GET /missing.html: %s", r.substr (0, r.find ('\r')).c_str());
+  server->stop();
+}
+
+/// Drop connections in the middle of a sendfile() transfer, the host process must survive without SIGPIPE.
+static void
+test_http_abort (const std::string &docroot)
+{
+  const std::string big (20 * 1024 * 1024, 'x');
+  CHECK (write_string_atomic (docroot + "/big.txt", big), "failed to write big.txt");
+  write_string_atomic (docroot + "/small.txt", "small");
+  HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions { .docroot = docroot });
+  CHECK (server->listen() == 0, "failed to listen");
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (server->port());
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  for (int i = 0; i < 5; i++) {
+    const int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const std::string request = "GET /big.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char buffer[4096];
+    if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == 0 && write (fd, request.data(), request.size()) == ssize_t (request.size()))
+      CHECK (read (fd, buffer, sizeof (buffer)) > 0, "GET /big.txt: no response");
+    shutdown (fd, SHUT_RDWR);
+    close (fd);
+  }
+  usleep (100 * 1000);  // let the server run into EPIPE
+  const std::string r = http_get (server->port(), "/small.txt");
+  CHECK (r.compare (0, 15, "HTTP/1.1 200 OK") == 0, "GET /small.txt: %s", r.substr (0, r.find ('\r')).c_str());
+  server->stop();
+}
+
+/// Lines longer than LogOptions::max_line are split, also when their newline arrives within the same read.
+static void
+test_log_max_line ()
+{
+  int fds[2];
+  CHECK (pipe2 (fds, O_CLOEXEC) == 0, "pipe2: %s", strerror (errno));
+  LogOptions options;
+  options.max_line = 16;
+  LogCapture capture (options, fds[0]);
+  const std::string text = std::string (40, 'a') + "\n" + std::string (16, 'b') + "\nshort\n" + std::string (20, 'c');
+  CHECK (write (fds[1], text.data(), text.size()) == ssize_t (text.size()), "write: %s", strerror (errno));
+  close (fds[1]);
+  while (capture.read_input() >= 0) {}
+  capture.finish();
+  const std::vector<LogLine> lines = capture.lines (LogSeverity::Verbose);
+  const std::vector<size_t> sizes = { 16, 16, 8, 16, 5, 16, 4 };
+  CHECK (lines.size() == sizes.size(), "lines: %zu", lines.size());
+  for (size_t i = 0; i < std::min (lines.size(), sizes.size()); i++)
+    CHECK (lines[i].text.size() == sizes[i], "line %zu: size %zu", i, lines[i].text.size());
+}
+
+/// Drop a JsonIpc connection in the middle of a large write, the lost bytes must not keep the queue congested.
+static void
+test_jsonipc_lost_write ()
+{
+  HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions());
+  CHECK (server->listen() == 0, "failed to listen");
+  JsonIpc ipc (server);
+  const int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const int rcvbuf = 4096;
+  setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (server->port());
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  const std::string request = "GET " + ipc.endpoint() + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+  std::string response;
+  char buffer[1024];
+  ssize_t n = 0;
+  if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == 0 && write (fd, request.data(), request.size()) == ssize_t (request.size()))
+    while (response.find ("\r\n\r\n") == std::string::npos && (n = read (fd, buffer, sizeof (buffer))) > 0)
+      response.append (buffer, n);
+  CHECK (response.compare (0, 12, "HTTP/1.1 101") == 0, "upgrade: %s", response.substr (0, response.find ('\r')).c_str());
+  for (int i = 0; i < 1000 && !ipc.connected(); i++)
+    usleep (1000);
+  const std::string big = "\"" + std::string (6 * 1024 * 1024, 'x') + "\"";
+  CHECK (ipc.send (big), "first send rejected");
+  usleep (100 * 1000);  // the write stalls, the client does not read
+  close (fd);           // unread data makes this a reset
+  for (int i = 0; i < 2000 && (ipc.connected() || ipc.queued()); i++)
+    usleep (1000);
+  CHECK (!ipc.connected(), "still connected");
+  CHECK (ipc.queued() == 0, "queued after failed write: %zu", ipc.queued());
+  CHECK (ipc.send (big), "send rejected after failed write");
+  server->stop();
+}
+
+/// Send CDP commands after the browser closed its end of the command pipe, this must fail them instead of raising SIGPIPE.
+static void
+test_cdp_closed ()
+{
+  int commands[2], replies[2];
+  CHECK (pipe2 (commands, O_CLOEXEC) == 0 && pipe2 (replies, O_CLOEXEC) == 0, "pipe2: %s", strerror (errno));
+  close (commands[0]);  // browser gone, but its reply pipe is still open, so the pump keeps waiting
+  int failed = 0;
+  {
+    CdpPipe cdp (commands[1], replies[0]);
+    for (int i = 0; i < 3; i++)
+      cdp.call ("Browser.getVersion", "{}", [&failed] (bool ok, const std::string&) { failed += !ok; }, false);
+    cdp.call ("Page.reload", "{}", [&failed] (bool ok, const std::string&) { failed += !ok; }, true);
+  }
+  CHECK (failed == 4, "failed callbacks: %d", failed);
+  close (replies[1]);
+}
+
+int
+main (int argc, const char *argv[])
+{
+  namespace fs = std::filesystem;
+  const int iterations = argc > 1 ? atoi (argv[1]) : 20;
+  std::error_code ec{};
+  const fs::path fake = fs::canonical ("/proc/self/exe", ec).parent_path() / "fake-browser";
+  char tmpl[] = "/tmp/session-test-XXXXXX";
+  if (access (fake.c_str(), X_OK) != 0 || !mkdtemp (tmpl)) {
+    dprintf (2, "%s:%s: missing stand-in browser or tempdir: %s\n", __FILE__, __func__, fake.c_str());
+    return 1;
+  }
+  const fs::path root = tmpl;
+  for (const char *dir : { "bin", "home", "cache", "run", "docroot" })
+    path_mkdirs (root / dir);
+  fs::create_symlink (fake, root / "bin" / "chromium", ec);
+  setenv ("PATH", (root / "bin").c_str(), 1);
+  setenv ("HOME", (root / "home").c_str(), 1);
+  setenv ("XDG_CACHE_HOME", (root / "cache").c_str(), 1);
+  setenv ("XDG_RUNTIME_DIR", (root / "run").c_str(), 1);
+  test_log_max_line();
+  test_bundle_serving();
+  test_http_abort (root / "docroot");
+  test_cdp_closed();
+  test_jsonipc_lost_write();
+  const std::vector<BrowserInfo> browsers = web_head_find (BrowserType::Chromium, FindOptions { .use_cache = false });
+  CHECK (browsers.size() == 1, "stand-in browser not detected");
+  if (browsers.size()) {
+    test_code_cache_appname (browsers[0]);
+    test_exit_fd_running (browsers[0], iterations);
+  }
+  fs::remove_all (root, ec);
+  printf ("%s: %s\n", argv[0], failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+// This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
+#include "../src/webhead.cc"
+#include <stdio.h>
+
+using namespace WebHead;
+
+/// Print `name` with percentiles of `samples` in µs.
+static void
+print_percentiles (const std::string &name, const std::string &labels, std::vector<double> samples)
+{
+  std::sort (samples.begin(), samples.end());
+  if (samples.empty())
+    printf ("%s: %sn=0\n", name.c_str(), labels.c_str());
+  else
+    printf ("%s: %sn=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", name.c_str(), labels.c_str(), samples.size(),
+            samples[samples.size() * 50 / 100], samples[samples.size() * 90 / 100], samples[samples.size() * 99 / 100], samples.back());
+}
+
+/// Microseconds since `t0`.
+static double
+elapsed_us (const std::chrono::steady_clock::time_point &t0)
+{
+  return std::chrono::duration<double, std::micro> (std::chrono::steady_clock::now() - t0).count();
+}
+
+/// Session phases recorded via SessionOptions::on_phase.
+struct PhaseWaiter {
+  std::mutex              mutex;
+  std::condition_variable cond;
+  SessionStats            stats;
+  void
+  record (SessionPhase, const SessionStats &s)
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    stats = s;
+    cond.notify_all();
+  }
+  bool
+  wait (uint64_t SessionStats::*field, int timeout_ms)
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    return cond.wait_for (lock, std::chrono::milliseconds (timeout_ms), [&] () { return stats.*field != 0; });
+  }
+};
+
+/// Discovery with and without the browser cache.
+static void
+bench_find (int iterations)
+{
+  std::vector<double> cold, warm, serial;
+  for (int i = 0; i < iterations; i++) {
+    auto t0 = std::chrono::steady_clock::now();
+    web_head_find (BrowserType::Any, FindOptions { .parallel = true, .use_cache = false });
+    cold.push_back (elapsed_us (t0));
+    t0 = std::chrono::steady_clock::now();
+    web_head_find (BrowserType::Any, FindOptions { .parallel = false, .use_cache = false });
+    serial.push_back (elapsed_us (t0));
+  }
+  web_head_find (BrowserType::Any, FindOptions { .rescan = true });
+  for (int i = 0; i < iterations; i++) {
+    const auto t0 = std::chrono::steady_clock::now();
+    web_head_find (BrowserType::Any, FindOptions());
+    warm.push_back (elapsed_us (t0));
+  }
+  print_percentiles ("webhead.find_cold_us", "", cold);
+  print_percentiles ("webhead.find_cold_serial_us", "", serial);
+  print_percentiles ("webhead.find_warm_us", "", warm);
+}
+
+/// Profile creation next to stale host/PID directories, followed by one gc() pass.
+static void
+bench_tempdir (const BrowserInfo &browser, int iterations, size_t stale_dirs, size_t stale_files)
+{
+  namespace fs = std::filesystem;
+  const fs::path basedir = fs::path (cache_home()) / "WebHead";
+  for (size_t d = 0; d < stale_dirs; d++) {
+    // PIDs above the kernel limit of 4194304 are never alive
+    const fs::path stale = basedir / (hostpid_prefix() + posix_printf ("%zu", 4200000 + d)) / "chromium-1";
+    path_mkdirs (stale);
+    for (size_t f = 0; f < stale_files; f++)
+      write_string (stale / posix_printf ("f%zu", f), std::string (512, 'x'));
+  }
+  std::vector<double> samples;
+  for (int i = 0; i < iterations; i++) {
+    const auto t0 = std::chrono::steady_clock::now();
+    const std::string pdir = create_profile (browser, "bench", ProfilePlacement());
+    samples.push_back (elapsed_us (t0));
+    if (pdir.empty())
+      dprintf (2, "%s:%s: failed to create profile: %s\n", __FILE__, __func__, strerror (errno));
+  }
+  print_percentiles ("webhead.tempdir_us", posix_printf ("stale_dirs=%zu stale_files=%zu ", stale_dirs, stale_files), samples);
+  const auto t0 = std::chrono::steady_clock::now();
+  const GcStats gs = gc();
+  printf ("webhead.gc: dirs=%zu files=%zu bytes=%zu complete=%d us=%.1f\n", gs.dirs, gs.files, gs.bytes, gs.complete, elapsed_us (t0));
+}
+
+/// Start and stop sessions one at a time, measuring spawn-to-running and kill-to-reaped latency.
+static void
+bench_spawn (const BrowserInfo &browser, int iterations, const HttpServerP &server)
+{
+  const std::string labels = "browser=" + std::filesystem::path (browser.executable).filename().string() + " ";
+  std::vector<double> start, first_log, first_request, reaped;
+  for (int i = 0; i < iterations; i++) {
+    PhaseWaiter waiter;
+    SessionOptions options;
+    options.background_gc = false;
+    options.http_server = server;
+    options.on_phase = [&waiter] (SessionPhase phase, const SessionStats &stats) { waiter.record (phase, stats); };
+    Session session ("index.html", "bench", options);
+    const auto t0 = std::chrono::steady_clock::now();
+    if (int err = session.start (browser)) {
+      dprintf (2, "%s:%s: failed to start %s: %s\n", __FILE__, __func__, browser.executable.c_str(), strerror (err));
+      return;
+    }
+    start.push_back (elapsed_us (t0));
+    if (waiter.wait (&SessionStats::first_log, 5000))
+      first_log.push_back (waiter.stats.first_log - waiter.stats.start);
+    if (waiter.wait (&SessionStats::first_request, 5000))
+      first_request.push_back (waiter.stats.first_request - waiter.stats.start);
+    const auto t1 = std::chrono::steady_clock::now();
+    session.shutdown (3000);
+    reaped.push_back (elapsed_us (t1));
+  }
+  print_percentiles ("webhead.start_us", labels, start);
+  print_percentiles ("webhead.spawn_to_running_us", labels, first_log);
+  print_percentiles ("webhead.first_request_us", labels, first_request);
+  print_percentiles ("webhead.kill_to_reaped_us", labels, reaped);
+}
+
+/// Start `count` sessions back to back and wait until all are running.
+static void
+bench_throughput (const BrowserInfo &browser, size_t count)
+{
+  std::vector<std::unique_ptr<PhaseWaiter>> waiters;
+  std::vector<std::unique_ptr<Session>> sessions;
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    waiters.push_back (std::make_unique<PhaseWaiter>());
+    PhaseWaiter *waiter = waiters.back().get();
+    SessionOptions options;
+    options.background_gc = false;
+    options.on_phase = [waiter] (SessionPhase phase, const SessionStats &stats) { waiter->record (phase, stats); };
+    sessions.push_back (std::make_unique<Session> ("about:blank", "bench", options));
+    if (int err = sessions.back()->start (browser))
+      dprintf (2, "%s:%s: failed to start %s: %s\n", __FILE__, __func__, browser.executable.c_str(), strerror (err));
+  }
+  size_t running = 0;
+  for (auto &waiter : waiters)
+    running += waiter->wait (&SessionStats::first_log, 5000);
+  const double seconds = elapsed_us (t0) / 1000000;
+  const auto t1 = std::chrono::steady_clock::now();
+  for (auto &session : sessions)
+    session->kill (SIGTERM);
+  for (auto &session : sessions)
+    session->shutdown (3000);
+  printf ("webhead.sessions: browser=%s sessions=%zu running=%zu seconds=%.3f sessions_per_second=%.1f shutdown_seconds=%.3f\n",
+          std::filesystem::path (browser.executable).filename().c_str(), count, running, seconds, running / seconds,
+          elapsed_us (t1) / 1000000);
+}
+
+int
+main (int argc, const char *argv[])
+{
+  namespace fs = std::filesystem;
+  const int iterations = argc > 1 ? atoi (argv[1]) : 20;
+  const size_t sessions = argc > 2 ? atoll (argv[2]) : 50;
+  std::error_code ec{};
+  const fs::path fake = fs::canonical ("/proc/self/exe", ec).parent_path() / "fake-browser";
+  if (access (fake.c_str(), X_OK) != 0) {
+    dprintf (2, "%s:%s: missing stand-in browser: %s\n", __FILE__, __func__, fake.c_str());
+    return 1;
+  }
+  // isolate discovery, profiles and caches from the real environment
+  char tmpl[] = "/tmp/webhead-bench-XXXXXX";
+  if (!mkdtemp (tmpl)) {
+    dprintf (2, "%s:%s: mkdtemp: %s\n", __FILE__, __func__, strerror (errno));
+    return 1;
+  }
+  const fs::path root = tmpl;
+  for (const char *dir : { "bin", "home", "cache", "run", "www" })
+    path_mkdirs (root / dir);
+  for (const char *name : { "chromium", "google-chrome", "firefox", "epiphany-browser" })
+    fs::create_symlink (fake, root / "bin" / name, ec);
+  write_string (root / "www" / "index.html", "<!DOCTYPE html>\n<title>webhead-bench</title>\n");
+  setenv ("PATH", (root / "bin").c_str(), 1);
+  setenv ("HOME", (root / "home").c_str(), 1);
+  setenv ("XDG_CACHE_HOME", (root / "cache").c_str(), 1);
+  setenv ("XDG_RUNTIME_DIR", (root / "run").c_str(), 1);
+  setenv ("FAKE_BROWSER_FETCH", "1", 1);
+  bench_find (iterations);
+  std::vector<BrowserInfo> browsers = web_head_find (BrowserType::Any);
+  const auto chromium = std::find_if (browsers.begin(), browsers.end(), [] (const BrowserInfo &b) { return b.type == BrowserType::Chromium; });
+  if (chromium == browsers.end()) {
+    dprintf (2, "%s:%s: stand-in browser not detected\n", __FILE__, __func__);
+    return 1;
+  }
+  bench_tempdir (*chromium, iterations, 16, 2000);
+  HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions { .docroot = root / "www" });
+  if (int err = server->listen()) {
+    dprintf (2, "%s:%s: failed to listen: %s\n", __FILE__, __func__, strerror (err));
+    return 1;
+  }
+  for (BrowserType type : { BrowserType::Chromium, BrowserType::Firefox, BrowserType::Epiphany })
+    for (const BrowserInfo &browser : browsers)
+      if (browser.type == type) {
+        bench_spawn (browser, iterations, server);
+        break;
+      }
+  bench_throughput (*chromium, sessions);
+  server->stop();
+  fs::remove_all (root, ec);
+  return 0;
+}
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
+"""Embed a frontend directory as WebHead::Bundle in a generated C++ header.
+
+Usage: webhead-bundle.py [--name NAME] [--include webhead.hh] --output bundle.hh DIRECTORY
+
+Every file gets precompressed gzip and brotli variants (if smaller), an ETag
+per variant derived from the content hash, its MIME type and a slot in a
+perfect hash table, see Bundle::find().  All definitions are inline, so
+the header may be included by several translation units.  Brotli needs the `brotli` Python
+module or command line tool, otherwise only gzip variants are generated.
+"""
+import argparse, gzip, hashlib, os, re, shutil, subprocess, sys
+
+# keep in sync with mime_type() in webhead.cc
+MIME_TYPES = {
+  '.html': 'text/html; charset=utf-8', '.htm': 'text/html; charset=utf-8',
+  '.css': 'text/css; charset=utf-8', '.js': 'text/javascript; charset=utf-8',
+  '.mjs': 'text/javascript; charset=utf-8', '.json': 'application/json',
+  '.map': 'application/json', '.svg': 'image/svg+xml',
+  '.png': 'image/png', '.jpg': 'image/jpeg',
+  '.jpeg': 'image/jpeg', '.gif': 'image/gif',
+  '.webp': 'image/webp', '.ico': 'image/x-icon',
+  '.woff': 'font/woff', '.woff2': 'font/woff2',
+  '.ttf': 'font/ttf', '.wasm': 'application/wasm',
+  '.txt': 'text/plain; charset=utf-8', '.xml': 'application/xml',
+}
+# already compressed formats
+INCOMPRESSIBLE = { '.png', '.jpg', '.jpeg', '.gif', '.webp', '.woff', '.woff2' }
+
+def fnv1a (key, seed):
+  """Bundle::hash() of webhead.hh"""
+  h = 2166136261 ^ seed
+  for c in key.encode():
+    h = ((h ^ c) * 16777619) & 0xffffffff
+  return h
+
+def perfect_hash (keys):
+  """Find a displacement seed per bucket, so every key lands in its own slot."""
+  count = len (keys)
+  buckets = max (1, (count + 3) // 4)
+  groups = [[] for _ in range (buckets)]
+  for key in keys:
+    groups[fnv1a (key, 0) % buckets].append (key)
+  seeds = [0] * buckets
+  slots = [None] * count
+  for b in sorted (range (buckets), key = lambda b: -len (groups[b])):
+    if not groups[b]:
+      continue
+    seed = 1
+    while True:
+      wanted = [fnv1a (key, seed) % count for key in groups[b]]
+      if len (set (wanted)) == len (wanted) and all (slots[s] is None for s in wanted):
+        break
+      seed += 1
+    seeds[b] = seed
+    for key, s in zip (groups[b], wanted):
+      slots[s] = key
+  return seeds, slots
+
+def brotli_compress (data):
+  try:
+    import brotli
+    return brotli.compress (data, quality = 11)
+  except ImportError:
+    pass
+  if shutil.which ('brotli'):
+    return subprocess.run (['brotli', '-c', '-q', '11', '-'], input = data, stdout = subprocess.PIPE, check = True).stdout
+  return None
+
+def c_array (name, data):
+  body = ','.join (str (b) for b in data) or '0'
+  lines = re.sub (r'((?:\d+,){32})', r'\1\n  ', body)
+  return 'alignas (16) inline constexpr unsigned char %s[] = {\n  %s\n};\n' % (name, lines)
+
+def c_string (s):
+  return '"' + s.replace ('\\', '\\\\').replace ('"', '\\"') + '"'
+
+def main():
+  parser = argparse.ArgumentParser (description = 'Embed a frontend directory as WebHead::Bundle')
+  parser.add_argument ('directory')
+  parser.add_argument ('--output', '-o', required = True)
+  parser.add_argument ('--name', default = 'frontend', help = 'C++ identifier of the Bundle')
+  parser.add_argument ('--include', default = 'webhead.hh', help = 'path of webhead.hh for #include')
+  args = parser.parse_args()
+  if not re.fullmatch (r'[A-Za-z_][A-Za-z0-9_]*', args.name):
+    sys.exit ('%s: invalid --name: %s' % (sys.argv[0], args.name))
+  files = []
+  for root, dirs, names in os.walk (args.directory):
+    dirs.sort()
+    for name in sorted (names):
+      filename = os.path.join (root, name)
+      files.append (('/' + os.path.relpath (filename, args.directory).replace (os.sep, '/'), filename))
+  seeds, slots = perfect_hash ([path for path, _ in files])
+  filenames = dict (files)
+  ns = 'WebHeadBundle_' + args.name
+  out = [ '// Generated by webhead-bundle.py from %s, do not edit\n' % args.directory,
+          '#pragma once\n#include "%s"\n\nnamespace %s {\n' % (args.include, ns) ]
+  entries = []
+  for i, path in enumerate (slots):
+    data = open (filenames[path], 'rb').read()
+    ext = os.path.splitext (path)[1].lower()
+    digest = hashlib.sha1 (data).hexdigest()[:20]
+    variants = { 'identity': data }
+    if ext not in INCOMPRESSIBLE and len (data) > 256:
+      for encoding, compressed in (('gzip', gzip.compress (data, 9, mtime = 0)), ('br', brotli_compress (data))):
+        if compressed is not None and len (compressed) < len (data) * 0.9:
+          variants[encoding] = compressed
+    blobs = []
+    for encoding in ('identity', 'gzip', 'br'):
+      if encoding in variants:
+        out.append (c_array ('f%d_%s' % (i, encoding), variants[encoding]))
+        etag = '"%s%s"' % (digest, '' if encoding == 'identity' else '-' + encoding)
+        blobs.append ('{ f%d_%s, %d, %s }' % (i, encoding, len (variants[encoding]), c_string (etag)))
+      else:
+        blobs.append ('{}')
+    entries.append ('  { %s, %s,\n    %s },\n' % (c_string (path), c_string (MIME_TYPES.get (ext, 'application/octet-stream')), ', '.join (blobs)))
+  out.append ('inline constexpr WebHead::BundleFile files[] = {\n%s};\n' % (''.join (entries) or '  {},\n'))
+  out.append ('inline constexpr uint32_t seeds[] = { %s };\n' % ', '.join (str (s) for s in seeds))
+  out.append ('} // %s\n\n' % ns)
+  out.append ('inline constexpr WebHead::Bundle %s = { "%s", %s::files, %d, %s::seeds, %d };\n' %
+              (args.name, args.name, ns, len (slots), ns, len (seeds)))
+  tmpfile = args.output + '.tmp'
+  with open (tmpfile, 'w') as f:
+    f.write (''.join (out))
+  os.replace (tmpfile, args.output)
+
+if __name__ == '__main__':
+  main()
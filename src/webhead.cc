@@ -4,9 +4,44 @@
 #include <locale.h>
 #include <stdarg.h>
 #include <sys/time.h>
-#include <boost/process.hpp>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <signal.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/uuid/detail/sha1.hpp>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <deque>
 #include <regex>
+#include <thread>
+#include <unordered_map>
 
 #define WEBHEAD_DEBUG(...)      do { if (0) dprintf (2, __VA_ARGS__); } while (0)
 
@@ -24,6 +59,20 @@ string_join (const std::string &junctor, const std::vector<std::string> &strvec)
   return s;
 }
 
+/// Split a string at `separator`.
+static std::vector<std::string>
+string_split (const std::string &string, char separator)
+{
+  std::vector<std::string> strvec;
+  size_t start = 0;
+  for (size_t i = string.find (separator); i != std::string::npos; i = string.find (separator, start)) {
+    strvec.push_back (string.substr (start, i - start));
+    start = i + 1;
+  }
+  strvec.push_back (string.substr (start));
+  return strvec;
+}
+
 /// Create std::string from printf() format style in the Posix C locale.
 static std::string
 posix_printf (const char *format, ...)
@@ -52,23 +101,415 @@ host_name()
   return buffer;
 }
 
+// == Child processes ==
+/// Open a pidfd for `pid` or return -1, see pidfd_open(2).
+static int
+pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/// Move `fd` above the standard and CDP pipe fds with FD_CLOEXEC, so it can be installed in a child with dup2().
+static int
+child_fd (int fd)
+{
+  if (fd < 0) return -1;
+  const int moved = fcntl (fd, F_DUPFD_CLOEXEC, 10);
+  close (fd);
+  return moved;
+}
+
+/// Run the write `io` with SIGPIPE blocked in the calling thread, so a closed peer yields EPIPE instead of killing the process.
+template<class IO> static ssize_t
+write_nosigpipe (const IO &io)
+{
+  sigset_t pipeset, old;
+  sigemptyset (&pipeset);
+  sigaddset (&pipeset, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &pipeset, &old);
+  const ssize_t n = io();
+  const int saved_errno = errno;
+  sigset_t pending;
+  if (!sigismember (&old, SIGPIPE) && sigpending (&pending) == 0 && sigismember (&pending, SIGPIPE)) {
+    // discard the SIGPIPE raised by `io` (also on partial writes), it would be delivered once unblocked
+    const struct timespec nowait = {};
+    while (sigtimedwait (&pipeset, nullptr, &nowait) < 0 && errno == EINTR) {}
+  }
+  pthread_sigmask (SIG_SETMASK, &old, nullptr);
+  errno = saved_errno;
+  return n;
+}
+
+/// Attributes of a child process, applied between clone and exec.
+struct ChildSetup {
+  std::vector<std::pair<int,int>> fds;  // (parent fd, child fd), parent fds must not collide with child fds
+  int    cgroup_procs = -1;             // cgroup.procs of the web head cgroup, opened for writing
+  bool   process_group = true;          // start a new process group, so helpers can be signalled together
+  int    nice = 0;
+  int    ioprio = -1;
+  size_t rlimit_data = 0;
+  /// Connect stdin to `input` and stdout plus stderr to `output`, which is truncated.
+  bool
+  redirect (const std::string &input, const std::string &output)
+  {
+    return redirect (input, open (output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  }
+  /// Connect stdin to `input` and stdout plus stderr to `outputfd`, which is closed by release().
+  bool
+  redirect (const std::string &input, int outputfd)
+  {
+    const int in = child_fd (open (input.c_str(), O_RDONLY | O_CLOEXEC));
+    const int out = child_fd (outputfd);
+    if (in >= 0)
+      fds.push_back ({ in, 0 });
+    if (out >= 0)
+      fds.insert (fds.end(), { { out, 1 }, { out, 2 } });
+    return in >= 0 && out >= 0;
+  }
+  /// Runs in the child on the stack of the parent, only async-signal-safe calls are allowed.
+  void
+  apply () const
+  {
+    // the cgroup fd may be clobbered by dup2()
+    if (cgroup_procs >= 0 && write (cgroup_procs, "0", 1) < 0) {}
+    if (process_group)
+      setpgid (0, 0);
+    for (const auto &fd : fds)
+      dup2 (fd.first, fd.second);       // clears FD_CLOEXEC on the new fd
+    if (nice > 0)
+      setpriority (PRIO_PROCESS, 0, nice);
+    if (ioprio >= 0) {
+      const int IOPRIO_WHO_PROCESS = 1;
+      syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+    }
+    if (rlimit_data) {
+      const struct rlimit rl = { rlim_t (rlimit_data), rlim_t (rlimit_data) };
+      setrlimit (RLIMIT_DATA, &rl);
+    }
+  }
+  /// Close the parent side of inherited fds after spawning.
+  void
+  release ()
+  {
+    std::vector<int> parentfds;
+    for (const auto &fd : fds)
+      if (std::find (parentfds.begin(), parentfds.end(), fd.first) == parentfds.end())
+        parentfds.push_back (fd.first);
+    for (int fd : parentfds)
+      close (fd);
+    fds.clear();
+    if (cgroup_procs >= 0)
+      close (cgroup_procs);
+    cgroup_procs = -1;
+  }
+};
+
+/// A child process spawned without copying the page tables of the parent, see ChildProcess::spawn().
+class ChildProcess {
+  pid_t pid_ = -1;
+  int   pidfd_ = -1;
+  std::atomic<int>  exit_code_ = -1;
+  std::atomic<bool> reaped_ = false;  // read by running() and reaped() from any thread
+  void
+  set_exit (int status)
+  {
+    exit_code_ = WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status);
+    reaped_ = true;
+  }
+public:
+  ChildProcess () = default;
+  ChildProcess (const ChildProcess&) = delete;
+  ChildProcess& operator= (const ChildProcess&) = delete;
+  /// Kill the child if it is still running and reap it.
+  ~ChildProcess()
+  {
+    terminate();
+    if (pidfd_ >= 0) close (pidfd_);
+  }
+  int   spawn     (const std::string &executable, const std::vector<std::string> &args, const ChildSetup &setup,
+                   const std::vector<std::string> *environment = nullptr);
+  pid_t id        () const      { return pid_; }
+  bool  valid     () const      { return pid_ > 0; }
+  int   pidfd     () const      { return pidfd_; }
+  int   exit_code () const      { return exit_code_; }
+  bool  reaped    () const      { return reaped_; }
+  /// Check if the child is running, an exited child is left for wait(), so waitid (WNOWAIT) watchers still see its exit.
+  bool
+  running () const
+  {
+    if (!valid() || reaped_) return false;
+    siginfo_t info = {};
+    return waitid (P_PID, pid_, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+  }
+  /// Wait for the child to exit and reap it.
+  void
+  wait ()
+  {
+    int status = 0;
+    if (!valid() || reaped_) return;
+    pid_t r;
+    do
+      r = waitpid (pid_, &status, 0);
+    while (r < 0 && errno == EINTR);
+    if (r == pid_)
+      set_exit (status);
+    else
+      reaped_ = true;   // ECHILD, reaped elsewhere
+  }
+  /// Kill the child with SIGKILL and reap it.
+  void
+  terminate ()
+  {
+    if (!valid() || reaped_) return;
+    ::kill (pid_, SIGKILL);
+    wait();
+  }
+};
+
+/// Arguments for spawn_child_main(), shared with the child.
+struct SpawnArgs {
+  const char       *path;
+  char *const      *argv;
+  char *const      *envp;
+  const ChildSetup *setup;
+  const sigset_t   *sigmask;
+  int               error;      // errno of a failed execve()
+};
+
+/// Child side of ChildProcess::spawn(), runs on a separate stack in the memory of the suspended parent.
+static int
+spawn_child_main (void *data)
+{
+  SpawnArgs &args = *(SpawnArgs*) data;
+  // handlers of the parent must not run here, the signal handler table is not shared
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction action = {};
+    if (sigaction (sig, nullptr, &action) == 0 && action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) {
+      action = {};
+      action.sa_handler = SIG_DFL;
+      sigaction (sig, &action, nullptr);
+    }
+  }
+  args.setup->apply();
+  sigprocmask (SIG_SETMASK, args.sigmask, nullptr);
+  execve (args.path, args.argv, args.envp);
+  args.error = errno ? errno : ENOEXEC;
+  _exit (127);
+}
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD     0x00001000      // Linux 5.2
+#endif
+
+/// Spawn `executable` with clone (CLONE_VM | CLONE_VFORK), returns errno.
+/// Unlike fork(), this does not copy the page tables of a large parent, the parent is suspended until the exec.
+int
+ChildProcess::spawn (const std::string &executable, const std::vector<std::string> &args, const ChildSetup &setup,
+                     const std::vector<std::string> *environment)
+{
+  if (valid()) return EBUSY;
+  // everything the child needs is allocated up front
+  std::vector<char*> argv = { const_cast<char*> (executable.c_str()) }, envp;
+  for (const std::string &arg : args)
+    argv.push_back (const_cast<char*> (arg.c_str()));
+  argv.push_back (nullptr);
+  if (environment) {
+    for (const std::string &var : *environment)
+      envp.push_back (const_cast<char*> (var.c_str()));
+    envp.push_back (nullptr);
+  }
+  const size_t stack_size = 128 * 1024;
+  void *stack = mmap (nullptr, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+    return errno;
+  // no signal handler may run in the child before it reset the dispositions
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  SpawnArgs spawnargs { .path = executable.c_str(), .argv = argv.data(), .envp = environment ? envp.data() : environ,
+                        .setup = &setup, .sigmask = &old, .error = 0 };
+  int pidfd = -1;
+  pid_t pid = clone (spawn_child_main, (char*) stack + stack_size, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &spawnargs, &pidfd);
+  if (pid < 0 && errno == EINVAL)
+    pid = clone (spawn_child_main, (char*) stack + stack_size, CLONE_VM | CLONE_VFORK | SIGCHLD, &spawnargs);
+  const int err = pid < 0 ? errno : spawnargs.error;
+  pthread_sigmask (SIG_SETMASK, &old, nullptr);
+  munmap (stack, stack_size);
+  WEBHEAD_DEBUG ("%s: %s %s: %s\n", __func__, executable.c_str(), string_join (" ", args).c_str(), strerror (err));
+  if (pid > 0 && err) {
+    waitpid (pid, nullptr, 0);
+    if (pidfd >= 0) close (pidfd);
+  }
+  if (err)
+    return err;
+  pid_ = pid;
+  pidfd_ = pidfd >= 0 ? pidfd : pidfd_open (pid);
+  return 0;
+}
+
+/// Find `name` in $PATH, yields "" if it is not an executable.
+static std::string
+search_path (const std::string &name)
+{
+  const char *path = getenv ("PATH");
+  for (const std::string &dir : string_split (path ? path : "/usr/bin:/bin", ':')) {
+    const std::string candidate = std::filesystem::path (dir.empty() ? "." : dir) / name;
+    struct stat st = {};
+    if (stat (candidate.c_str(), &st) == 0 && S_ISREG (st.st_mode) && access (candidate.c_str(), X_OK) == 0)
+      return candidate;
+  }
+  return "";
+}
+
+/// Wait up to `timeout_ms` for `child` to exit and reap it, returns false on timeout.
+static bool
+wait_child (ChildProcess &child, int timeout_ms)
+{
+  const int pidfd = child.pidfd();
+  if (pidfd >= 0) {
+    struct pollfd pfd = { pidfd, POLLIN, 0 };
+    int n;
+    do
+      n = poll (&pfd, 1, timeout_ms);
+    while (n < 0 && errno == EINTR);
+    if (n == 0)
+      return false;
+  }
+  child.wait();
+  return true;
+}
+
+/// Wait up to `timeout_ms` (-1 for no limit) for `pid` to exit, without reaping it, returns false on timeout.
+static bool
+wait_exit (pid_t pid, int timeout_ms)
+{
+  const int pidfd = pidfd_open (pid);
+  if (pidfd >= 0) {
+    struct pollfd pfd = { pidfd, POLLIN, 0 };
+    int n;
+    do
+      n = poll (&pfd, 1, timeout_ms);
+    while (n < 0 && errno == EINTR);
+    close (pidfd);
+    return n != 0;
+  }
+  // without pidfd support, check every millisecond
+  for (int i = 0; timeout_ms < 0 || i < timeout_ms; i++) {
+    siginfo_t info = {};
+    if (waitid (P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == pid)
+      return true;
+    usleep (1000);
+  }
+  return false;
+}
+
+/// Exit code and captured output of a program run via concurrent_exec().
+struct ExecResult {
+  int         exit_code = -1;
+  std::string out, err;
+  bool        timedout = false;
+};
+
+/// Run several programs at once on a shared io_context, capture their output and kill those exceeding `timeout_ms` (unless <= 0).
+static std::vector<ExecResult>
+concurrent_exec (const std::vector<std::pair<std::string,std::vector<std::string>>> &commands, int timeout_ms)
+{
+  namespace asio = boost::asio;
+  asio::io_context ioc;
+  struct Probe {
+    explicit Probe (asio::io_context &ioc) : pout (ioc), perr (ioc), exitfd (ioc), timer (ioc) {}
+    asio::posix::stream_descriptor pout, perr;
+    asio::streambuf bout, berr;
+    asio::posix::stream_descriptor exitfd;      // pidfd, readable once the child exited
+    asio::steady_timer timer;
+    ChildProcess child;
+    int error = 0;
+    int pending = 0;
+    bool timedout = false;
+  };
+  std::vector<std::unique_ptr<Probe>> probes;
+  for (const auto &cmd : commands) {
+    probes.push_back (std::make_unique<Probe> (ioc));
+    Probe *p = probes.back().get();
+    int outpipe[2] = { -1, -1 }, errpipe[2] = { -1, -1 };
+    if (pipe2 (outpipe, O_CLOEXEC) != 0 || pipe2 (errpipe, O_CLOEXEC) != 0) {
+      p->error = errno;
+      for (int fd : { outpipe[0], outpipe[1] })
+        if (fd >= 0) close (fd);
+      continue;
+    }
+    ChildSetup setup;
+    setup.process_group = false;
+    setup.fds = { { child_fd (open ("/dev/null", O_RDONLY | O_CLOEXEC)), 0 },
+                  { child_fd (outpipe[1]), 1 }, { child_fd (errpipe[1]), 2 } };
+    p->error = setup.fds[0].first >= 0 && setup.fds[1].first >= 0 && setup.fds[2].first >= 0 ? p->child.spawn (cmd.first, cmd.second, setup) : EMFILE;
+    setup.release();
+    p->pout.assign (outpipe[0]);
+    p->perr.assign (errpipe[0]);
+    if (p->error)
+      continue;
+    auto done = [p] () {
+      if (--p->pending == 0)
+        p->timer.cancel();
+    };
+    auto read_all = [done] (asio::posix::stream_descriptor &pipe, asio::streambuf &buffer) {
+      asio::async_read (pipe, buffer, [done] (const boost::system::error_code&, size_t) { done(); });
+    };
+    p->pending = 2;
+    read_all (p->pout, p->bout);
+    read_all (p->perr, p->berr);
+    const int pidfd = p->child.pidfd() >= 0 ? fcntl (p->child.pidfd(), F_DUPFD_CLOEXEC, 0) : -1;
+    if (pidfd >= 0) {
+      p->pending += 1;
+      p->exitfd.assign (pidfd);
+      p->exitfd.async_wait (asio::posix::stream_descriptor::wait_read, [done] (const boost::system::error_code&) { done(); });
+    }
+    if (timeout_ms <= 0)
+      continue;
+    p->timer.expires_after (std::chrono::milliseconds (timeout_ms));
+    p->timer.async_wait ([p] (const boost::system::error_code &ec) {
+      if (ec == asio::error::operation_aborted || p->pending == 0)
+        return;
+      // a hung browser wrapper or a lingering grandchild holding the pipes must not stall the scan
+      WEBHEAD_DEBUG ("concurrent_exec: timeout, pid=%d\n", p->child.id());
+      p->timedout = true;
+      p->child.terminate();
+      boost::system::error_code ignored;
+      p->pout.close (ignored);
+      p->perr.close (ignored);
+      p->exitfd.close (ignored);
+    });
+  }
+  ioc.run();
+  std::vector<ExecResult> results;
+  for (auto &p : probes) {
+    ExecResult r;
+    if (p->error)
+      r.exit_code = p->error;
+    else if (p->timedout)
+      r.timedout = true;
+    else {
+      p->child.wait();
+      r.exit_code = p->child.exit_code();
+      r.out.assign (asio::buffers_begin (p->bout.data()), asio::buffers_end (p->bout.data()));
+      r.err.assign (asio::buffers_begin (p->berr.data()), asio::buffers_end (p->berr.data()));
+    }
+    results.push_back (std::move (r));
+  }
+  return results;
+}
+
 /// Run program and capture output.
 static std::tuple<int,std::string,std::string>
 synchronous_exec (const std::string &path, const std::vector<std::string> &args)
 {
-  namespace bp = boost::process;
-  // bp::ipstream pout, perr;
-  std::future<std::string> pout, perr;
-  boost::asio::io_context ioc;
-  std::error_code ec{};
-  bp::child cproc (path, bp::args (args), bp::std_out > pout, bp::std_err > perr, ioc, ec);
-  WEBHEAD_DEBUG ("%s: %s %s: %s\n", __func__, path.c_str(), string_join (" ", args).c_str(), strerror (ec.value()));
-  if (ec.value())
-    return { ec.value(), "", "" };
-  ioc.run();
-  cproc.wait();
-  const int exit_code = ec.value() ? ec.value() : cproc.exit_code();
-  return { exit_code, pout.get(), perr.get() };
+  ExecResult r = concurrent_exec ({ { path, args } }, 0).at (0);
+  return { r.exit_code, std::move (r.out), std::move (r.err) };
 }
 
 /// Gather capture groups from a regex search match
@@ -112,6 +553,28 @@ write_string (const std::string &filename, const std::string &contents)
   ofile.close();
 }
 
+/// Read a file into a string, yields "" on error.
+static std::string
+read_string (const std::string &filename)
+{
+  std::ifstream ifile (filename);
+  std::stringstream contents;
+  contents << ifile.rdbuf();
+  return contents.str();
+}
+
+/// Write `contents` to a temporary file and atomically rename it to `filename`.
+static bool
+write_string_atomic (const std::string &filename, const std::string &contents)
+{
+  const std::string tmpfile = filename + posix_printf (".%u~", getpid());
+  write_string (tmpfile, contents);
+  if (rename (tmpfile.c_str(), filename.c_str()) == 0)
+    return true;
+  unlink (tmpfile.c_str());
+  return false;
+}
+
 /// Path of the current users home directory
 static std::string
 home_dir()
@@ -139,339 +602,4376 @@ timestamp_realtime ()
   return now.tv_sec * 1000000ULL + now.tv_usec;
 }
 
-/// Create new temporary dir and purge old dirs of the same kind.
+/// Return CLOCK_MONOTONIC as uint64 in µseconds.
+static uint64_t
+timestamp_monotonic ()
+{
+  struct timespec now = { 0, 0 };
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/// Prefix of host/PID directories created by processes on this host.
 static std::string
-create_hostpid_subdir (const std::string &parentdir, bool clean_stale_siblings)
+hostpid_prefix()
+{
+  return posix_printf ("%s-%08lx-", host_name(), gethostid());
+}
+
+/// Move a stale host/PID directory out of the way, returns the trash path or "".
+static std::string
+trash_stale_dir (const std::string &parentdir, const std::string &name, size_t pid, bool blocking)
 {
   namespace fs = std::filesystem;
-  // determine dirname for current and previous sessions
-  const std::string prefix = posix_printf ("%s-%08lx-", host_name(), gethostid());
-  if (clean_stale_siblings) {
-    std::vector<std::string> others;
-    std::error_code ec{};
-    for (const auto &entry : fs::directory_iterator (parentdir, ec)) {
-      // find previous session with stale PID in directory name
-      const std::string sibling = entry.path().filename();
-      if (sibling.compare (0, prefix.size(), prefix) != 0) continue;
-      char *endptr = nullptr;
-      const size_t sibling_pid = strtoul (sibling.c_str() + prefix.size(), &endptr, 10);
-      if (sibling_pid <= 0 || (endptr && *endptr)) continue;
-      if (kill (sibling_pid, 0) == -1 && errno == ESRCH) {
-        WEBHEAD_DEBUG ("%s: cleaning stale temp dir: %s\n", __func__, entry.path().c_str());
-        std::error_code ec;
-        std::filesystem::remove_all (entry.path(), ec);
-      }
-    }
+  const std::string dir = fs::path (parentdir) / name;
+  const int fd = open (dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return "";
+  std::string trash;
+  // live sessions hold LOCK_SH on their directory, see create_hostpid_subdir()
+  struct stat locked = {}, current = {};
+  if (flock (fd, LOCK_EX | (blocking ? 0 : LOCK_NB)) == 0 && fstat (fd, &locked) == 0 &&
+      stat (dir.c_str(), &current) == 0 && locked.st_ino == current.st_ino && locked.st_dev == current.st_dev &&
+      (pid == size_t (getpid()) || (::kill (pid, 0) == -1 && errno == ESRCH))) {
+    // with the inode verified and locked, nobody else can rename or recreate `dir` until we are done
+    trash = fs::path (parentdir) / posix_printf (".trash-%s-%llu", name.c_str(), timestamp_realtime());
+    if (rename (dir.c_str(), trash.c_str()) != 0)
+      trash = "";
+    WEBHEAD_DEBUG ("%s: stale temp dir: %s -> %s\n", __func__, dir.c_str(), trash.c_str());
   }
-  // create directory with PID of the current session
-  const std::string host_dir = fs::path (parentdir) / (prefix + posix_printf ("%u", getpid()));
-  if (path_exists (host_dir)) {
+  close (fd);
+  return trash;
+}
+
+/// Create new temporary dir, stale dirs of the same kind are left to gc().
+static std::string
+create_hostpid_subdir (const std::string &parentdir)
+{
+  namespace fs = std::filesystem;
+  // determine dirname for current and previous sessions
+  const std::string prefix = hostpid_prefix();
+  const std::string name = prefix + posix_printf ("%u", getpid());
+  // create directory with PID of the current session, reuse it for further sessions
+  const std::string host_dir = fs::path (parentdir) / name;
+  static std::mutex mutex;
+  static std::vector<std::string> created_dirs;
+  std::lock_guard<std::mutex> lock (mutex);
+  if (std::find (created_dirs.begin(), created_dirs.end(), host_dir) != created_dirs.end() && path_exists (host_dir))
+    return host_dir;
+  // a leftover from a previous process with our PID is stale by definition
+  if (path_exists (host_dir) && trash_stale_dir (parentdir, name, getpid(), true).empty()) {
     errno = EEXIST;
     return "";
   }
-  return path_mkdirs (host_dir) ? host_dir : "";
+  if (!path_mkdirs (host_dir))
+    return "";
+  // keep a shared lock for the lifetime of this process, so gc() elsewhere never touches host_dir
+  const int fd = open (host_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    flock (fd, LOCK_SH);
+  created_dirs.push_back (host_dir);
+  return host_dir;
+}
+
+/// Get the $XDG_RUNTIME_DIR directory or "", see: https://specifications.freedesktop.org/basedir-spec/latest
+static std::string
+runtime_dir ()
+{
+  namespace fs = std::filesystem;
+  const char *var = getenv ("XDG_RUNTIME_DIR");
+  if (var && fs::path (var).is_absolute() && path_exists (var))
+    return var;
+  return "";
+}
+
+/// Check if the file system of `dir` has at least `bytes` available.
+static bool
+path_has_space (const std::string &dir, size_t bytes)
+{
+  struct statvfs sv = {};
+  return statvfs (dir.c_str(), &sv) == 0 && size_t (sv.f_bavail) * sv.f_frsize >= bytes;
+}
+
+/// Determine the backing store of `path`.
+static ProfileStore
+path_store (const std::string &path)
+{
+  struct statfs sf = {};
+  if (path.empty() || statfs (path.c_str(), &sf) != 0)
+    return ProfileStore::None;
+  constexpr decltype (sf.f_type) TMPFS_MAGIC = 0x01021994, RAMFS_MAGIC = 0x858458f6;
+  return sf.f_type == TMPFS_MAGIC || sf.f_type == RAMFS_MAGIC ? ProfileStore::Tmpfs : ProfileStore::Disk;
+}
+
+/// Create a unique profile dir under the host/PID dir in `basedir`.
+static std::string
+create_tempdir_in (const std::string &basedir, const std::string &subdir)
+{
+  namespace fs = std::filesystem;
+  const std::string runtimedir = create_hostpid_subdir (basedir); // ~/.../WebHead/hostname-aabbccdd-123
+  if (runtimedir.empty()) return "";
+  // concurrent callers (e.g. a ProfilePool) may race for the same timestamp, create_directory() claims atomically
+  for (long long unsigned stamp = timestamp_realtime(), i = 0; i < 16; i++) {
+    const fs::path tempdir = fs::path (runtimedir) / (subdir + posix_printf ("%llu", stamp + i));
+    std::error_code ec{};
+    if (fs::create_directory (tempdir, ec))
+      return tempdir;
+    if (ec) return "";
+  }
+  errno = EEXIST;
+  return "";
 }
 
 // Create suitable temporary WebHead directory, take snap R/W limitations into account.
 static std::string
-create_webhead_tempdir (const std::string &executable, const std::string &appname, bool forsnap)
+create_webhead_tempdir (const std::string &executable, const std::string &appname, bool forsnap, const ProfilePlacement &placement)
 {
   namespace fs = std::filesystem;
   std::string basedir, exename = fs::path (executable).filename();
+  const std::string subdir = forsnap ? "" : exename + "-";
+  // Prefer $XDG_RUNTIME_DIR (tmpfs) if it has room, snap apps may write to $XDG_RUNTIME_DIR/snap.<self>/
+  const std::string rundir = placement.tmpfs ? runtime_dir() : "";
+  if (!rundir.empty() && path_has_space (rundir, placement.tmpfs_reserve)) {
+    const std::string tmpfsdir = forsnap ? fs::path (rundir) / ("snap." + exename) / "WebHead" : fs::path (rundir) / "WebHead";
+    const std::string tempdir = create_tempdir_in (tmpfsdir, subdir);
+    if (!tempdir.empty())
+      return tempdir;
+    WEBHEAD_DEBUG ("%s: falling back to disk, failed to create in: %s: %s\n", __func__, tmpfsdir.c_str(), strerror (errno));
+  }
   // Many snap apps can only write under ~/snap/<self>/current/
   if (forsnap)
     basedir = fs::path (home_dir()) / "snap" / exename / "current" / "WebHead";
   else
     basedir = fs::path (cache_home()) / "WebHead";
-  const std::string runtimedir = create_hostpid_subdir (basedir, true); // ~/.../WebHead/hostname-aabbccdd-123
-  std::string subdir = forsnap ? "" : exename + "-";
-  subdir += posix_printf ("%llu", timestamp_realtime());
-  const fs::path tempdir = fs::path (runtimedir) / subdir;
-  return !path_exists (tempdir) && path_mkdirs (tempdir) ? tempdir : "";
+  return create_tempdir_in (basedir, subdir);
 }
 
-// == detect existing browsers ==
-struct BrowserCheck {
-  std::string exename;
-  std::string versionpattern;
-  BrowserType browsertype;
-};
-static const BrowserCheck web_head_browser_checks[] = {
-  { "firefox",                  "(Mozilla\\s*)(Firefox\\s*)([0-9]+[-0-9.a-z+]*).*",       BrowserType::Firefox },
-  { "firefox-esr",              "(Mozilla\\s*)(Firefox\\s*)([0-9]+[-0-9.a-z+]*).*",       BrowserType::Firefox },
-  { "google-chrome",            "(Google\\s*)(Chrome\\s\\s*)([0-9]+[-0-9.a-z+]*).*",      BrowserType::GoogleChrome },
-  // "google-chrome-stable", "google-chrome-beta", "google-chrome-unstable" have one canonical alias, "google-chrome"
-  { "chromium",                 "(Chromium\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                BrowserType::Chromium },
-  // "chromium-browser", is a wrapper, so cannot be detected as ~/snap/chromium-browser
-  // find epiphany-browser_*.deb
-  { "epiphany-browser",         "(Web\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                     BrowserType::Epiphany },
-  // find /snap/bin/epiphany on Ubuntu
-  { "/snap/bin/epiphany",       "(Web\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                     BrowserType::Epiphany },
+// == Stale profile garbage collection ==
+/// Budget and quit flag for a single gc() pass.
+struct GcPass {
+  const GcOptions         &options;
+  const std::atomic<bool> *quit = nullptr;
+  std::chrono::steady_clock::time_point deadline;
+  GcStats                  stats;
+  bool
+  exhausted() const
+  {
+    return (quit && *quit) ||
+           (options.max_bytes && stats.bytes >= options.max_bytes) ||
+           (options.max_ms > 0 && std::chrono::steady_clock::now() >= deadline);
+  }
 };
 
-/// Find and return a list of browsers in $PATH that can be used as web heads.
-std::vector<BrowserInfo>
-web_head_find (BrowserType type)
+/// Remove `path` recursively within the budget of `pass`, returns false if `path` is left incomplete.
+static bool
+remove_budgeted (const std::filesystem::path &path, GcPass &pass)
 {
-  namespace bp = boost::process;
   namespace fs = std::filesystem;
-  std::vector<BrowserInfo> browsers;
-  for (size_t j = 0; j < sizeof (web_head_browser_checks) / sizeof (web_head_browser_checks[0]); j++)
-    if (type == BrowserType::Any || type == web_head_browser_checks[j].browsertype) {
-      const BrowserCheck &check = web_head_browser_checks[j];
-      boost::filesystem::path exename = check.exename;
-      const std::string path = exename.is_absolute() ? exename.string() : bp::search_path (check.exename).string();
-      if (path.empty()) continue;
-      BrowserInfo b { .executable = path, .type = check.browsertype };
-      const auto& [ex, out, err] = synchronous_exec (b.executable, { "--version" });
-      if (ex != 0 || 0 == out.size()) continue;
-      WEBHEAD_DEBUG ("%s: %s:\n%s%sexit_code=%d\n", __func__, b.executable.c_str(), out.c_str(), err.c_str(), ex);
-      const std::vector<std::string> groups = regex_capture (check.versionpattern, out);
-      if (groups.size()) {
-        b.identification = groups[0];
-        b.version = groups[groups.size() - 1];
-        // check for `~/snap/browser/` *after* --version test, so a ~/snap/<self>/current/ dir has already been created
-        if (path_exists (fs::path (home_dir()) / "snap" / check.exename))
-          b.snapdir = true;
-        browsers.push_back (b);
+  struct stat st = {};
+  if (lstat (path.c_str(), &st) != 0)
+    return errno == ENOENT;
+  if (S_ISDIR (st.st_mode)) {
+    std::error_code ec{};
+    for (const auto &entry : fs::directory_iterator (path, ec))
+      if (!remove_budgeted (entry.path(), pass))
+        return false;
+  }
+  if (pass.exhausted())
+    return false;
+  if (::remove (path.c_str()) == 0) {
+    pass.stats.bytes += st.st_size;
+    pass.stats.files += 1;
+  }
+  return true;
+}
+
+/// Base directories that may contain WebHead profiles.
+static std::vector<std::string>
+gc_parent_dirs()
+{
+  namespace fs = std::filesystem;
+  std::vector<std::string> dirs = { fs::path (cache_home()) / "WebHead" };
+  std::error_code ec{};
+  for (const auto &entry : fs::directory_iterator (fs::path (home_dir()) / "snap", ec)) {
+    const fs::path webhead = entry.path() / "current" / "WebHead";
+    if (path_exists (webhead))
+      dirs.push_back (webhead);
+  }
+  const std::string rundir = runtime_dir();
+  if (!rundir.empty()) {
+    dirs.push_back (fs::path (rundir) / "WebHead");
+    for (const auto &entry : fs::directory_iterator (rundir, ec))
+      if (entry.path().filename().string().compare (0, 5, "snap.") == 0 && path_exists (entry.path() / "WebHead"))
+        dirs.push_back (entry.path() / "WebHead");
+  }
+  return dirs;
+}
+
+/// Remove profile directories of dead processes on this host.
+static GcStats
+gc_pass (const GcOptions &options, const std::atomic<bool> *quit)
+{
+  namespace fs = std::filesystem;
+  GcPass pass { .options = options, .quit = quit, .deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds (options.max_ms) };
+  const std::string prefix = hostpid_prefix(), trashprefix = ".trash-" + prefix;
+  for (const std::string &parentdir : gc_parent_dirs()) {
+    std::vector<std::string> trash;
+    std::error_code ec{};
+    for (const auto &entry : fs::directory_iterator (parentdir, ec)) {
+      const std::string sibling = entry.path().filename();
+      // leftovers from interrupted passes
+      if (sibling.compare (0, trashprefix.size(), trashprefix) == 0) {
+        trash.push_back (entry.path());
+        continue;
+      }
+      // find previous session with stale PID in directory name
+      if (sibling.compare (0, prefix.size(), prefix) != 0) continue;
+      char *endptr = nullptr;
+      const size_t sibling_pid = strtoul (sibling.c_str() + prefix.size(), &endptr, 10);
+      if (sibling_pid <= 0 || (endptr && *endptr)) continue;
+      if (::kill (sibling_pid, 0) == -1 && errno == ESRCH) {
+        const std::string moved = trash_stale_dir (parentdir, sibling, sibling_pid, false);
+        if (!moved.empty())
+          trash.push_back (moved);
+      }
+    }
+    for (const std::string &dir : trash) {
+      if (!remove_budgeted (dir, pass)) {
+        pass.stats.complete = false;
+        return pass.stats;
       }
+      pass.stats.dirs += 1;
     }
-  return web_head_sort (browsers);
+  }
+  return pass.stats;
 }
 
-struct BrowserInfoLesser {
-  bool
-  operator() (const BrowserInfo &a, const BrowserInfo &b) const
+/// Remove profile directories left behind by terminated web heads, within the budget of `options`.
+GcStats
+gc (const GcOptions &options)
+{
+  return gc_pass (options, nullptr);
+}
+
+/// Background thread for gc_async(), joined at exit.
+struct GcThread {
+  std::mutex        mutex;
+  std::thread       thread;
+  std::atomic<bool> quit = false, busy = false;
+  ~GcThread()
   {
-    if (a.type != b.type)
-      return a.type < b.type;
-    if (a.version != b.version) // give precedence to higher versions
-      return strverscmp (a.version.c_str(), b.version.c_str()) > 0;
-    if (a.identification != b.identification)
-      return strcmp (a.identification.c_str(), b.identification.c_str()) < 0;
-    if (a.snapdir != b.snapdir)
-      return a.snapdir < b.snapdir;
-    if (a.executable != b.executable)
-      return a.executable < b.executable;
-    return false;
+    quit = true;
+    if (thread.joinable())
+      thread.join();
   }
 };
 
-/// Sort browser list by type, version, etc.
-std::vector<BrowserInfo>
-web_head_sort (const std::vector<BrowserInfo> &browsers)
+/// Run gc() on a background thread with idle IO priority, unless a pass is already running.
+void
+gc_async (const GcOptions &options)
 {
-  std::vector<BrowserInfo> browservector = browsers;
-  std::stable_sort (browservector.begin(), browservector.end(), BrowserInfoLesser());
-  return browservector;
+  static GcThread gct;
+  std::lock_guard<std::mutex> lock (gct.mutex);
+  if (gct.busy || gct.quit)
+    return;
+  if (gct.thread.joinable())
+    gct.thread.join();
+  gct.busy = true;
+  gct.thread = std::thread ([options] () {
+    if (options.idle_io) {
+      // IOPRIO_WHO_PROCESS with 0 applies to the calling thread only
+      const int IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13, IOPRIO_WHO_PROCESS = 1;
+      syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    }
+    const GcStats stats = gc_pass (options, &gct.quit);
+    WEBHEAD_DEBUG ("gc_async: removed %zu dirs, %zu files, %zu bytes, complete=%d\n", stats.dirs, stats.files, stats.bytes, stats.complete);
+    gct.busy = false;
+  });
 }
 
-/// Session::Process simply wraps boost::process::child.
-struct Session::Process {
-  boost::process::child child = {};
-};
-
-/// Write generic files to browser profile
-static void
-create_profile_files (const std::string &profiledir, const std::string &exename, bool snapdir, const std::string &url, const std::string appname)
+// == detect existing browsers ==
+/// Read `key` from the `[section]` of an INI file like Firefox's application.ini.
+static std::string
+ini_value (const std::string &inifile, const std::string &section, const std::string &key)
 {
-  namespace fs = std::filesystem;
-  const auto s =
-    posix_printf ("WebHead directory to host temporary profile:\n\nApplication=%s\nWebHead=%s\n", appname.c_str(), exename.c_str());
-  write_string (fs::path (profiledir) / "WebHead.txt", s);
+  std::string current;
+  for (const std::string &line : string_split (read_string (inifile), '\n'))
+    if (line.size() > 2 && line[0] == '[' && line.back() == ']')
+      current = line.substr (1, line.size() - 2);
+    else if (current == section && line.compare (0, key.size() + 1, key + "=") == 0)
+      return line.substr (key.size() + 1);
+  return "";
 }
 
-/// Start chromium type browsers
-static Session::ProcessP
-start_chromium (const std::string &executable, bool snapdir, const std::string &url, const std::string appname)
+/// Yield the snap name if `executable` is a /snap/bin/ wrapper of an already used snap, see snap_version().
+static std::string
+snap_name (const std::string &executable)
 {
   namespace fs = std::filesystem;
-  namespace bp = boost::process;
-  const std::string exename = fs::path (executable).filename();
-  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir);
-  if (pdir == "") return nullptr;
-  create_profile_files (pdir, exename, snapdir, url, appname);
-  const std::string logfile = fs::path (pdir) / "WebHead.log";
-  // https://www.chromium.org/developers/how-tos/run-chromium-with-flags/
-  // https://peter.sh/experiments/chromium-command-line-switches/
-  std::vector<std::string> args = {
-    "--user-data-dir=" + pdir,          // Avoids "Opening in existing browser session"
-    "--incognito",
-    "--no-first-run",                   // Avoid popup for empty profile
-    "--no-experiments",
-    "--no-default-browser-check",
-    "--disable-extensions",
-    "--disable-sync",
-    "--bwsi",
-    "--new-window",
-    "--app=" + url,
-  };
-  WEBHEAD_DEBUG ("%s: %s %s\n", __func__, executable.c_str(), string_join (" ", args).c_str());
-  Session::ProcessP pp = std::make_shared<Session::Process>();
   std::error_code ec{};
-  pp->child = bp::child (executable, bp::args (args), (bp::std_err & bp::std_out) > logfile, bp::std_in < bp::null, ec);
-  errno = ec.value();
-  return pp;
+  if (fs::canonical (executable, ec) != "/usr/bin/snap" || ec)
+    return "";
+  const std::string name = fs::path (executable).filename();
+  // the ~/snap/<name>/current/ dir must exist, the caller relies on it for BrowserInfo.snapdir
+  if (!path_exists (fs::path (home_dir()) / "snap" / name / "current"))
+    return "";
+  return name;
 }
 
-/// Start the Epiphany browser
-static Session::ProcessP
-start_epiphany (const std::string &executable, bool snapdir, const std::string &url, const std::string appname)
+/// Read `version:` from /snap/<name>/current/meta/snap.yaml.
+static std::string
+snap_version (const std::string &name)
+{
+  for (std::string line : string_split (read_string (std::filesystem::path ("/snap") / name / "current" / "meta" / "snap.yaml"), '\n'))
+    if (line.compare (0, 8, "version:") == 0) {
+      line.erase (0, line.find_first_not_of (" \t'\"", 8));
+      line.erase (line.find_last_not_of (" \t'\"\r") + 1);
+      return line;
+    }
+  return "";
+}
+
+/// Upstream version of an installed Debian `package`, if it owns `executable`.
+static std::string
+dpkg_version (const std::string &package, const std::string &executable)
 {
   namespace fs = std::filesystem;
-  namespace bp = boost::process;
-  const std::string exename = fs::path (executable).filename();
-  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir);
-  if (pdir == "") return nullptr;
-  const fs::path applications = fs::path (pdir) / "applications";
-  if (!path_mkdirs (applications)) return nullptr;
-  create_profile_files (pdir, exename, snapdir, url, appname);
-  // epiphany --application-mode needs a desktop file
-  const fs::path desktopfile = applications / (appname + ".desktop");
-  const std::string desktopentry =
-    "[Desktop Entry]\nVersion=1.0\nType=Application\nStartupNotify=true\nTerminal=false\n" +
-    posix_printf ("Exec=epiphany -a %s.desktop\n", appname.c_str()) +
-    posix_printf ("StartupWMClass=%s\n", appname.c_str()) +
-    posix_printf ("Name=%s\n", appname.c_str());
-  write_string (desktopfile, desktopentry);
-  const std::string logfile = fs::path (pdir) / "WebHead.log";
-  // https://manpages.debian.org/unstable/epiphany-browser/epiphany.1.en.html
-  std::vector<std::string> args = {
-    "-a", appname + ".desktop",         // --application-mode avoids normal browser behaviour
-    // "--incognito",
-    "--new-window",
-    url,
+  std::error_code ec{};
+  const std::string resolved = fs::canonical (executable, ec);
+  if (ec) return "";
+  // the package must list the resolved executable, so local installs are not mistaken for packaged ones
+  const std::string filelist = "\n" + read_string ("/var/lib/dpkg/info/" + package + ".list");
+  const std::string filelist_amd64 = "\n" + read_string ("/var/lib/dpkg/info/" + package + ":amd64.list");
+  if (filelist.find ("\n" + resolved + "\n") == std::string::npos && filelist_amd64.find ("\n" + resolved + "\n") == std::string::npos)
+    return "";
+  const std::string status = read_string ("/var/lib/dpkg/status");
+  const size_t start = status.find ("Package: " + package + "\n");
+  if (start != 0 && (start == std::string::npos || status[start - 1] != '\n'))
+    return "";
+  const std::string stanza = status.substr (start, status.find ("\n\n", start) - start);
+  if (stanza.find ("\nStatus: install ok installed\n") == std::string::npos)
+    return "";
+  const size_t v = stanza.find ("\nVersion: ");
+  if (v == std::string::npos) return "";
+  std::string version = stanza.substr (v + 10, stanza.find ('\n', v + 10) - v - 10);
+  const size_t epoch = version.find (':');
+  if (epoch != std::string::npos)
+    version.erase (0, epoch + 1);
+  const size_t revision = version.rfind ('-');
+  if (revision != std::string::npos)
+    version.erase (revision);
+  return version;
+}
+
+/// Reproduce `firefox --version` output from application.ini.
+static std::string
+firefox_metadata (const std::string &executable)
+{
+  namespace fs = std::filesystem;
+  std::error_code ec{};
+  const std::string name = snap_name (executable);
+  const fs::path resolved = fs::canonical (executable, ec);
+  if (ec) return "";
+  const std::string appini = !name.empty() ? fs::path ("/snap") / name / "current" / "usr" / "lib" / name / "application.ini" :
+                             resolved.parent_path() / "application.ini";
+  const std::string vendor = ini_value (appini, "App", "Vendor"), appname = ini_value (appini, "App", "Name");
+  const std::string version = ini_value (appini, "App", "Version");
+  if (vendor.empty() || appname.empty() || version.empty())
+    return "";
+  return vendor + " " + appname + " " + version + "\n";
+}
+
+/// Reproduce `chromium --version` output for the Chromium snap.
+static std::string
+chromium_metadata (const std::string &executable)
+{
+  // distribution packages append build host details that are not available on disk
+  const std::string name = snap_name (executable), version = name.empty() ? "" : snap_version (name);
+  return version.empty() ? "" : "Chromium " + version + " snap\n";
+}
+
+/// Reproduce `google-chrome --version` output from the Debian package status.
+static std::string
+google_chrome_metadata (const std::string &executable)
+{
+  const std::string version = dpkg_version ("google-chrome-stable", executable);
+  return version.empty() ? "" : "Google Chrome " + version + " \n";
+}
+
+/// Reproduce `epiphany --version` output from snap or Debian package metadata.
+static std::string
+epiphany_metadata (const std::string &executable)
+{
+  const std::string name = snap_name (executable);
+  const std::string version = !name.empty() ? snap_version (name) : dpkg_version ("epiphany-browser", executable);
+  return version.empty() ? "" : "Web " + version + "\n";
+}
+
+struct BrowserCheck {
+  std::string exename;
+  std::string versionpattern;
+  BrowserType browsertype;
+  std::string (*metadata) (const std::string &executable); // yields `--version` output without exec
+};
+static const BrowserCheck web_head_browser_checks[] = {
+  { "firefox",                  "(Mozilla\\s*)(Firefox\\s*)([0-9]+[-0-9.a-z+]*).*",       BrowserType::Firefox,           firefox_metadata },
+  { "firefox-esr",              "(Mozilla\\s*)(Firefox\\s*)([0-9]+[-0-9.a-z+]*).*",       BrowserType::Firefox,           firefox_metadata },
+  { "google-chrome",            "(Google\\s*)(Chrome\\s\\s*)([0-9]+[-0-9.a-z+]*).*",      BrowserType::GoogleChrome,      google_chrome_metadata },
+  // "google-chrome-stable", "google-chrome-beta", "google-chrome-unstable" have one canonical alias, "google-chrome"
+  { "chromium",                 "(Chromium\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                BrowserType::Chromium,          chromium_metadata },
+  // "chromium-browser", is a wrapper, so cannot be detected as ~/snap/chromium-browser
+  // find epiphany-browser_*.deb
+  { "epiphany-browser",         "(Web\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                     BrowserType::Epiphany,          epiphany_metadata },
+  // find /snap/bin/epiphany on Ubuntu
+  { "/snap/bin/epiphany",       "(Web\\s\\s*)([0-9]+[-0-9.a-z+]*).*",                     BrowserType::Epiphany,          epiphany_metadata },
+};
+
+// == browser discovery cache ==
+/// Identity of a browser installation, changes with package upgrades and snap refreshes.
+static std::string
+browser_identity (const std::string &exename, const std::string &executable)
+{
+  namespace fs = std::filesystem;
+  std::error_code ec{};
+  const std::string resolved = fs::canonical (executable, ec);
+  struct stat st = {};
+  if (ec || stat (resolved.c_str(), &st) != 0)
+    return "";
+  std::string identity = posix_printf ("%s:%llu:%llu:%lld.%09ld", resolved.c_str(),
+                                       (long long unsigned) st.st_ino, (long long unsigned) st.st_size,
+                                       (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  // snap wrappers resolve to /usr/bin/snap, so track the current snap revision
+  const std::string snapname = fs::path (exename).filename();
+  const std::string revision = fs::read_symlink (fs::path ("/snap") / snapname / "current", ec);
+  if (!ec)
+    identity += ";snap=" + revision;
+  // package managers may only upgrade the binaries behind wrapper scripts
+  if (stat ("/var/lib/dpkg/status", &st) == 0)
+    identity += posix_printf (";dpkg=%lld.%09ld", (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  ec.clear();
+  identity += fs::exists (fs::path (home_dir()) / "snap" / snapname, ec) ? ";snapdir=1" : ";snapdir=0";
+  return identity;
+}
+
+/// Discovery cache entry, `ok` is false for executables that failed the version check.
+struct BrowserCacheEntry {
+  std::string exename, identity;
+  bool ok = false;
+  BrowserInfo info;
+};
+
+/// Location of the persistent browser discovery cache.
+static std::string
+browser_cache_file()
+{
+  return std::filesystem::path (cache_home()) / "WebHead" / "browsers.cache";
+}
+
+/// Load all entries from the browser discovery cache.
+static std::vector<BrowserCacheEntry>
+browser_cache_load()
+{
+  std::vector<BrowserCacheEntry> entries;
+  const std::vector<std::string> lines = string_split (read_string (browser_cache_file()), '\n');
+  if (lines.empty() || lines[0] != "WebHead-browsers-1")
+    return entries;
+  for (size_t i = 1; i < lines.size(); i++) {
+    const std::vector<std::string> f = string_split (lines[i], '\t');
+    if (f.size() != 7) continue;
+    BrowserCacheEntry e { .exename = f[0], .identity = f[1], .ok = f[2] == "1" };
+    e.info = BrowserInfo { .executable = f[3], .identification = f[4], .version = f[5],
+                           .type = BrowserType (atoi (f[6].c_str())), .snapdir = e.identity.find (";snapdir=1") != std::string::npos };
+    entries.push_back (e);
+  }
+  return entries;
+}
+
+/// Replace the browser discovery cache with `entries`.
+static void
+browser_cache_save (const std::vector<BrowserCacheEntry> &entries)
+{
+  auto field = [] (std::string s) {
+    std::replace_if (s.begin(), s.end(), [] (char c) { return c == '\t' || c == '\n'; }, ' ');
+    return s;
   };
-  // extend $XDG_DATA_DIRS so epiphany can find {$XDG_DATA_DIRS}/applications/appname.desktop
-  bp::environment env = boost::this_process::environment();
-  const char *const XDG_DATA_DIRS = getenv ("XDG_DATA_DIRS"); // native readout, since bp::environment adds junk chars
-  env["XDG_DATA_DIRS"] = !XDG_DATA_DIRS ? pdir : pdir + ":" + XDG_DATA_DIRS;
-  WEBHEAD_DEBUG ("%s: XDG_DATA_DIRS=\"%s\" %s %s\n", __func__, env["XDG_DATA_DIRS"].to_string().c_str(), executable.c_str(), string_join (" ", args).c_str());
-  Session::ProcessP pp = std::make_shared<Session::Process>();
+  std::string contents = "WebHead-browsers-1\n";
+  for (const BrowserCacheEntry &e : entries)
+    contents += field (e.exename) + "\t" + field (e.identity) + "\t" + (e.ok ? "1" : "0") + "\t" +
+                field (e.info.executable) + "\t" + field (e.info.identification) + "\t" + field (e.info.version) + "\t" +
+                posix_printf ("%d", int (e.info.type)) + "\n";
+  const std::string cachefile = browser_cache_file();
+  if (path_mkdirs (std::filesystem::path (cachefile).parent_path()))
+    write_string_atomic (cachefile, contents);
+}
+
+/// Timing of the last web_head_find() call, reported by SessionStats.
+static struct {
+  std::mutex mutex;
+  uint64_t begin = 0, end = 0;
+} last_discovery;
+
+/// Find and return a list of browsers in $PATH that can be used as web heads.
+std::vector<BrowserInfo>
+web_head_find (BrowserType type)
+{
+  return web_head_find (type, FindOptions());
+}
+
+/// Find browsers in $PATH, optionally probing all candidates concurrently and caching results.
+std::vector<BrowserInfo>
+web_head_find (BrowserType type, const FindOptions &options)
+{
+  namespace fs = std::filesystem;
+  const uint64_t discovery_begin = timestamp_monotonic();
+  // collect candidates in $PATH
+  std::vector<BrowserInfo> candidates;
+  std::vector<const BrowserCheck*> checks;
+  for (size_t j = 0; j < sizeof (web_head_browser_checks) / sizeof (web_head_browser_checks[0]); j++)
+    if (type == BrowserType::Any || type == web_head_browser_checks[j].browsertype) {
+      const BrowserCheck &check = web_head_browser_checks[j];
+      const fs::path exename = check.exename;
+      const std::string path = exename.is_absolute() ? exename.string() : search_path (check.exename);
+      if (path.empty()) continue;
+      candidates.push_back (BrowserInfo { .executable = path, .type = check.browsertype });
+      checks.push_back (&check);
+    }
+  // use cached results for unchanged browser installations
+  std::vector<BrowserCacheEntry> cache = options.use_cache ? browser_cache_load() : std::vector<BrowserCacheEntry>();
+  std::vector<const BrowserCacheEntry*> cached (candidates.size(), nullptr);
+  if (!options.rescan)
+    for (size_t i = 0; i < candidates.size(); i++) {
+      const std::string identity = cache.empty() ? "" : browser_identity (checks[i]->exename, candidates[i].executable);
+      for (const BrowserCacheEntry &e : cache)
+        if (e.exename == checks[i]->exename && e.info.executable == candidates[i].executable && e.identity == identity)
+          cached[i] = &e;
+    }
+  // run `--version` probes for the rest, all at once in parallel mode
+  std::vector<size_t> probes;
+  for (size_t i = 0; i < candidates.size(); i++)
+    if (!cached[i])
+      probes.push_back (i);
+  std::vector<ExecResult> results (probes.size());
+  std::vector<size_t> execs;
+  for (size_t k = 0; k < probes.size(); k++) {
+    // prefer on-disk metadata, that reproduces the `--version` output exactly
+    const BrowserCheck &check = *checks[probes[k]];
+    results[k].out = options.use_metadata && check.metadata ? check.metadata (candidates[probes[k]].executable) : "";
+    if (!results[k].out.empty())
+      results[k].exit_code = 0;
+    else
+      execs.push_back (k);
+  }
+  if (options.parallel) {
+    std::vector<std::pair<std::string,std::vector<std::string>>> commands;
+    for (size_t k : execs)
+      commands.push_back ({ candidates[probes[k]].executable, { "--version" } });
+    const std::vector<ExecResult> outputs = concurrent_exec (commands, options.probe_timeout_ms);
+    for (size_t n = 0; n < execs.size(); n++)
+      results[execs[n]] = outputs[n];
+  } else
+    for (size_t k : execs) {
+      const auto& [ex, out, err] = synchronous_exec (candidates[probes[k]].executable, { "--version" });
+      results[k] = ExecResult { .exit_code = ex, .out = out, .err = err };
+    }
+  std::vector<BrowserInfo> browsers;
+  std::vector<BrowserCacheEntry> updates;
+  for (size_t i = 0; i < candidates.size(); i++)
+    if (cached[i] && cached[i]->ok)
+      browsers.push_back (cached[i]->info);
+  for (size_t k = 0; k < probes.size(); k++) {
+    BrowserInfo &b = candidates[probes[k]];
+    const BrowserCheck &check = *checks[probes[k]];
+    const auto& [ex, out, err, timedout] = results[k];
+    WEBHEAD_DEBUG ("%s: %s:\n%s%sexit_code=%d timedout=%d\n", __func__, b.executable.c_str(), out.c_str(), err.c_str(), ex, timedout);
+    const std::vector<std::string> groups = ex != 0 || 0 == out.size() ? std::vector<std::string>() : regex_capture (check.versionpattern, out);
+    if (groups.size()) {
+      b.identification = groups[0];
+      b.version = groups[groups.size() - 1];
+      // check for `~/snap/browser/` *after* --version test, so a ~/snap/<self>/current/ dir has already been created
+      if (path_exists (fs::path (home_dir()) / "snap" / check.exename))
+        b.snapdir = true;
+      browsers.push_back (b);
+    }
+    // identity is taken *after* the probe, for the same ~/snap/<self>/ reason
+    if (options.use_cache && !timedout)
+      updates.push_back (BrowserCacheEntry { .exename = check.exename, .identity = browser_identity (check.exename, b.executable),
+                                             .ok = groups.size() > 0, .info = b });
+  }
+  if (updates.size()) {
+    for (const BrowserCacheEntry &e : cache)
+      if (std::none_of (updates.begin(), updates.end(), [&e] (const BrowserCacheEntry &u) { return u.exename == e.exename; }))
+        updates.push_back (e);
+    browser_cache_save (updates);
+  }
+  std::vector<BrowserInfo> sorted = options.rank_by_cost ? web_head_sort (browsers, options.rank) : web_head_sort (browsers);
+  std::lock_guard<std::mutex> lock (last_discovery.mutex);
+  last_discovery.begin = discovery_begin;
+  last_discovery.end = timestamp_monotonic();
+  return sorted;
+}
+
+struct BrowserInfoLesser {
+  bool
+  operator() (const BrowserInfo &a, const BrowserInfo &b) const
+  {
+    if (a.type != b.type)
+      return a.type < b.type;
+    if (a.version != b.version) // give precedence to higher versions
+      return strverscmp (a.version.c_str(), b.version.c_str()) > 0;
+    if (a.identification != b.identification)
+      return strcmp (a.identification.c_str(), b.identification.c_str()) < 0;
+    if (a.snapdir != b.snapdir)
+      return a.snapdir < b.snapdir;
+    if (a.executable != b.executable)
+      return a.executable < b.executable;
+    return false;
+  }
+};
+
+/// Sort browser list by type, version, etc.
+std::vector<BrowserInfo>
+web_head_sort (const std::vector<BrowserInfo> &browsers)
+{
+  std::vector<BrowserInfo> browservector = browsers;
+  std::stable_sort (browservector.begin(), browservector.end(), BrowserInfoLesser());
+  return browservector;
+}
+
+// == Browser costs ==
+static constexpr size_t browser_cost_samples = 8;       // recent launches kept per browser
+static constexpr size_t browser_cost_entries = 32;      // browsers kept in the history
+static constexpr int    browser_cost_settle_ms = 5000;  // RSS is sampled this long after the web head is ready
+
+/// Recent launch times and RSS samples of one browser version.
+struct BrowserCostEntry {
+  std::string executable, version;
+  std::vector<double> launch_ms, rss;
+};
+
+/// Location of the launch cost history.
+static std::string
+browser_cost_file()
+{
+  return std::filesystem::path (cache_home()) / "WebHead" / "browsers.costs";
+}
+
+/// Parse a comma separated list of samples.
+static std::vector<double>
+cost_samples (const std::string &field)
+{
+  std::vector<double> samples;
+  for (const std::string &s : string_split (field, ','))
+    if (!s.empty())
+      samples.push_back (strtod (s.c_str(), nullptr));
+  return samples;
+}
+
+/// Load the launch cost history, most recently used browsers first.
+static std::vector<BrowserCostEntry>
+browser_cost_load()
+{
+  std::vector<BrowserCostEntry> entries;
+  const std::vector<std::string> lines = string_split (read_string (browser_cost_file()), '\n');
+  if (lines.empty() || lines[0] != "WebHead-costs-1")
+    return entries;
+  for (size_t i = 1; i < lines.size(); i++) {
+    const std::vector<std::string> f = string_split (lines[i], '\t');
+    if (f.size() == 4)
+      entries.push_back (BrowserCostEntry { .executable = f[0], .version = f[1], .launch_ms = cost_samples (f[2]), .rss = cost_samples (f[3]) });
+  }
+  return entries;
+}
+
+/// Add a launch to the history, `rss` is 0 if the web head exited before it settled.
+/// Concurrent writers from other processes may drop a sample, which only delays the ranking.
+static void
+browser_cost_record (const BrowserInfo &browser, double launch_ms, size_t rss)
+{
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock (mutex);
+  std::vector<BrowserCostEntry> entries = browser_cost_load();
+  auto it = std::find_if (entries.begin(), entries.end(), [&browser] (const BrowserCostEntry &e) {
+    return e.executable == browser.executable;
+  });
+  BrowserCostEntry entry { .executable = browser.executable, .version = browser.version };
+  // upgrades start a new history
+  if (it != entries.end() && it->version == browser.version)
+    entry = *it;
+  if (it != entries.end())
+    entries.erase (it);
+  auto add = [] (std::vector<double> &samples, double v) {
+    samples.push_back (v);
+    if (samples.size() > browser_cost_samples)
+      samples.erase (samples.begin());
+  };
+  add (entry.launch_ms, launch_ms);
+  if (rss)
+    add (entry.rss, rss);
+  entries.insert (entries.begin(), entry);
+  entries.resize (std::min (entries.size(), browser_cost_entries));
+  auto field = [] (std::string s) {
+    std::replace_if (s.begin(), s.end(), [] (char c) { return c == '\t' || c == '\n'; }, ' ');
+    return s;
+  };
+  auto join = [] (const std::vector<double> &samples) {
+    std::string r;
+    for (double v : samples)
+      r += (r.empty() ? "" : ",") + posix_printf ("%.0f", v);
+    return r;
+  };
+  std::string contents = "WebHead-costs-1\n";
+  for (const BrowserCostEntry &e : entries)
+    contents += field (e.executable) + "\t" + field (e.version) + "\t" + join (e.launch_ms) + "\t" + join (e.rss) + "\n";
+  const std::string costfile = browser_cost_file();
+  if (path_mkdirs (std::filesystem::path (costfile).parent_path()))
+    write_string_atomic (costfile, contents);
+}
+
+/// Median of `samples`, 0 if empty.
+static double
+median (std::vector<double> samples)
+{
+  if (samples.empty())
+    return 0;
+  std::sort (samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+/// Summarize the history of `browser` from `entries`.
+static BrowserCost
+browser_cost (const std::vector<BrowserCostEntry> &entries, const BrowserInfo &browser)
+{
+  for (const BrowserCostEntry &e : entries)
+    if (e.executable == browser.executable && e.version == browser.version)
+      return BrowserCost { .launches = e.launch_ms.size(), .launch_ms = median (e.launch_ms), .rss = size_t (median (e.rss)) };
+  return BrowserCost();
+}
+
+/// Recorded launch time and memory use of `browser`, see SessionOptions::record_costs.
+BrowserCost
+browser_cost (const BrowserInfo &browser)
+{
+  return browser_cost (browser_cost_load(), browser);
+}
+
+/// Sort browser list by the cost function of `rank`, ties keep the order of web_head_sort().
+std::vector<BrowserInfo>
+web_head_sort (const std::vector<BrowserInfo> &browsers, const RankOptions &rank)
+{
+  std::vector<BrowserInfo> sorted = web_head_sort (browsers);
+  const std::vector<BrowserCostEntry> entries = browser_cost_load();
+  std::vector<BrowserCost> costs;
+  double launch_sum = 0, rss_sum = 0;
+  size_t launch_n = 0, rss_n = 0;
+  for (const BrowserInfo &b : sorted) {
+    costs.push_back (browser_cost (entries, b));
+    launch_sum += costs.back().launch_ms;
+    launch_n += costs.back().launches > 0;
+    rss_sum += costs.back().rss;
+    rss_n += costs.back().rss > 0;
+  }
+  std::vector<std::pair<double,size_t>> scores;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    BrowserCost c = costs[i];
+    double score;
+    if (rank.cost)
+      score = rank.cost (sorted[i], c);
+    else {
+      // unmeasured browsers are assumed to be average, so only integration and the default order set them apart
+      if (!c.launches && launch_n)
+        c.launch_ms = launch_sum / launch_n;
+      if (!c.rss && rss_n)
+        c.rss = rss_sum / rss_n;
+      // only a missing app mode costs extra, equal costs keep the BrowserType order via stable_sort()
+      const bool app_mode = sorted[i].type != BrowserType::Firefox;
+      score = rank.launch_weight * c.launch_ms / 1000 + rank.memory_weight * c.rss / (1024.0 * 1024 * 1024) +
+              (app_mode ? 0 : rank.integration_weight);
+    }
+    scores.push_back ({ score, i });
+  }
+  std::stable_sort (scores.begin(), scores.end(), [] (const auto &a, const auto &b) { return a.first < b.first; });
+  std::vector<BrowserInfo> ranked;
+  for (const auto &[score, i] : scores) {
+    WEBHEAD_DEBUG ("%s: %s %s: cost=%.3f launches=%zu launch_ms=%.0f rss=%zu\n", __func__, sorted[i].executable.c_str(),
+                   sorted[i].version.c_str(), score, costs[i].launches, costs[i].launch_ms, costs[i].rss);
+    ranked.push_back (sorted[i]);
+  }
+  return ranked;
+}
+
+// == Resource accounting ==
+/// Read a small /proc file into a NUL terminated `buffer`, returns the number of bytes read.
+static size_t
+read_proc (const std::string &path, char *buffer, size_t size)
+{
+  const int fd = open (path.c_str(), O_RDONLY | O_CLOEXEC);
+  ssize_t n = 0;
+  if (fd >= 0) {
+    do
+      n = read (fd, buffer, size - 1);
+    while (n < 0 && errno == EINTR);
+    close (fd);
+  }
+  n = std::max (n, ssize_t (0));
+  buffer[n] = 0;
+  return n;
+}
+
+/// Parent PID from /proc/<pid>/stat, or 0.
+static pid_t
+proc_ppid (const std::string &pid)
+{
+  char buffer[1024];
+  read_proc ("/proc/" + pid + "/stat", buffer, sizeof (buffer));
+  const char *rparen = strrchr (buffer, ')');  // the command name may contain parenthesis
+  int ppid = 0;
+  return rparen && sscanf (rparen + 1, " %*c %d", &ppid) == 1 ? ppid : 0;
+}
+
+/// Check if processes of the web head remain in `cgroup`, or in the process group `pgid` without a cgroup.
+static bool
+process_group_alive (pid_t pgid, const std::string &cgroup)
+{
+  char buffer[1024];
+  // exiting processes leave their cgroup before they are reaped, so zombies do not count
+  if (!cgroup.empty() && read_proc (cgroup + "/cgroup.events", buffer, sizeof (buffer)))
+    return strstr (buffer, "populated 1") != nullptr;
+  // the PGID stays reserved while any member exists, zombie helpers linger until init reaps them
+  return ::kill (-pgid, 0) == 0;
+}
+
+/// Collect `root` and all its descendants, or all members of `cgroup` if given.
+static std::vector<pid_t>
+process_tree (pid_t root, const std::string &cgroup)
+{
+  namespace fs = std::filesystem;
+  std::vector<pid_t> pids;
+  if (!cgroup.empty()) {
+    for (const std::string &pid : string_split (read_string (cgroup + "/cgroup.procs"), '\n'))
+      if (!pid.empty())
+        pids.push_back (atoi (pid.c_str()));
+    if (!pids.empty())
+      return pids;
+  }
+  pids.push_back (root);
+  if (!path_exists (posix_printf ("/proc/%d/task/%d/children", root, root))) {
+    // without CONFIG_PROC_CHILDREN, scan all processes for their parents
+    std::unordered_map<pid_t, std::vector<pid_t>> children;
+    std::error_code ec{};
+    for (const auto &entry : fs::directory_iterator ("/proc", ec)) {
+      const std::string name = entry.path().filename();
+      if (name.find_first_not_of ("0123456789") == std::string::npos)
+        children[proc_ppid (name)].push_back (atoi (name.c_str()));
+    }
+    for (size_t i = 0; i < pids.size(); i++)
+      pids.insert (pids.end(), children[pids[i]].begin(), children[pids[i]].end());
+    return pids;
+  }
+  for (size_t i = 0; i < pids.size(); i++) {
+    // each thread has its own list of children, see proc(5)
+    std::error_code ec{};
+    for (const auto &task : fs::directory_iterator (posix_printf ("/proc/%d/task", pids[i]), ec)) {
+      char buffer[4096];
+      read_proc (task.path() / "children", buffer, sizeof (buffer));
+      for (const char *p = buffer; *p; ) {
+        char *endptr = nullptr;
+        const long child = strtol (p, &endptr, 10);
+        if (endptr == p) break;
+        pids.push_back (child);
+        p = endptr;
+      }
+    }
+  }
+  return pids;
+}
+
+/// Sample memory, CPU time and threads of `root` and its descendants, or the processes in `cgroup`.
+static ResourceSample
+sample_process_tree (pid_t root, const std::string &cgroup, const SampleOptions &options)
+{
+  static const long page_size = sysconf (_SC_PAGESIZE), clock_ticks = sysconf (_SC_CLK_TCK);
+  ResourceSample sample;
+  sample.stamp = timestamp_monotonic();
+  if (root <= 0)
+    return sample;
+  for (const pid_t pid : process_tree (root, cgroup)) {
+    char buffer[4096];
+    if (!read_proc (posix_printf ("/proc/%d/stat", pid), buffer, sizeof (buffer)))
+      continue;         // exited meanwhile
+    const char *lparen = strchr (buffer, '('), *rparen = strrchr (buffer, ')');
+    unsigned long long utime = 0, stime = 0;
+    long threads = 0, rss = 0;
+    // fields after the command name, see proc(5): state ... utime stime ... num_threads ... rss
+    if (!lparen || !rparen ||
+        sscanf (rparen + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+                &utime, &stime, &threads, &rss) != 4)
+      continue;
+    ProcessSample p { .pid = pid, .name = std::string (lparen + 1, rparen) };
+    p.rss = size_t (rss) * page_size;
+    p.cpu_us = (utime + stime) * 1000000ULL / clock_ticks;
+    p.threads = threads;
+    if (options.pss) {
+      char rollup[4096];
+      read_proc (posix_printf ("/proc/%d/smaps_rollup", pid), rollup, sizeof (rollup));
+      const char *pss = strstr (rollup, "\nPss:");
+      p.pss = pss ? strtoull (pss + 5, nullptr, 10) * 1024 : p.rss;
+    }
+    if (options.breakdown) {
+      char cmdline[8192];
+      const size_t n = read_proc (posix_printf ("/proc/%d/cmdline", pid), cmdline, sizeof (cmdline));
+      for (const char *arg = cmdline; arg < cmdline + n; arg += strlen (arg) + 1)
+        if (strncmp (arg, "--type=", 7) == 0)
+          p.role = arg + 7;
+    }
+    sample.rss += p.rss;
+    sample.pss += p.pss;
+    sample.cpu_us += p.cpu_us;
+    sample.threads += p.threads;
+    sample.processes += 1;
+    if (options.breakdown)
+      sample.breakdown.push_back (std::move (p));
+  }
+  return sample;
+}
+
+// == Resource limits ==
+/// Write `value` to a cgroup interface file.
+static bool
+cgroup_write (const std::string &filename, const std::string &value)
+{
+  const int fd = open (filename.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  const bool ok = write (fd, value.data(), value.size()) == ssize_t (value.size());
+  close (fd);
+  return ok;
+}
+
+/// Delegated cgroup v2 directory that web head cgroups are created in, or "".
+/// Controllers can only be enabled below it while it holds no processes, `move_host` moves the host process into an "app" leaf for that.
+static std::string
+cgroup_base (bool move_host)
+{
+  static std::mutex mutex;
+  static std::string self;
+  static bool checked = false, moved = false;
+  std::lock_guard<std::mutex> lock (mutex);
+  if (!checked) {
+    checked = true;
+    for (const std::string &line : string_split (read_string ("/proc/self/cgroup"), '\n'))
+      if (line.compare (0, 3, "0::") == 0)
+        self = "/sys/fs/cgroup" + (line == "0::/" ? "" : line.substr (3));
+    if (self.empty() || access ((self + "/cgroup.subtree_control").c_str(), W_OK) != 0 ||
+        access ((self + "/cgroup.procs").c_str(), W_OK) != 0)
+      self = "";        // not delegated to us
+  }
+  if (self.empty())
+    return "";
+  auto listed = [] (std::string list, const std::string &name) {
+    std::replace (list.begin(), list.end(), '\n', ' ');
+    return (" " + list + " ").find (" " + name + " ") != std::string::npos;
+  };
+  const std::string available = read_string (self + "/cgroup.controllers"), enabled = read_string (self + "/cgroup.subtree_control");
+  std::vector<std::string> enable;
+  for (const char *controller : { "memory", "cpu", "io" })
+    if (listed (available, controller) && !listed (enabled, controller))
+      enable.push_back (controller);
+  if (enable.empty())
+    return self;
+  if (move_host && !moved && self != "/sys/fs/cgroup") {
+    // no internal processes: controllers can only be enabled once our own processes live in a leaf
+    const std::string leaf = self + "/app";
+    moved = path_mkdirs (leaf) && cgroup_write (leaf + "/cgroup.procs", posix_printf ("%u", getpid()));
+  }
+  // fails with EBUSY while the host process lives in `self`, cgroup_create() then falls back to per process limits
+  for (const std::string &controller : enable)
+    if (!cgroup_write (self + "/cgroup.subtree_control", "+" + controller))
+      WEBHEAD_DEBUG ("%s: %s: failed to enable %s: %s\n", __func__, self.c_str(), controller.c_str(), strerror (errno));
+  return self;
+}
+
+/// Create a cgroup with `limits` for a web head, returns "" if cgroup delegation or a controller needed for `limits` is unavailable.
+static std::string
+cgroup_create (const ResourceLimits &limits)
+{
+  const std::string base = cgroup_base (limits.cgroup_move_host);
+  if (base.empty())
+    return "";
+  static std::atomic<unsigned> counter = 0;
+  const std::string cgroup = base + posix_printf ("/webhead-%u-%u", getpid(), ++counter);
+  if (mkdir (cgroup.c_str(), 0755) != 0)
+    return "";
+  bool ok = true;
+  if (limits.memory_high)
+    ok = ok && cgroup_write (cgroup + "/memory.high", posix_printf ("%zu", limits.memory_high));
+  if (limits.memory_max)
+    ok = ok && cgroup_write (cgroup + "/memory.max", posix_printf ("%zu", limits.memory_max));
+  if (limits.cpu_weight)
+    ok = ok && cgroup_write (cgroup + "/cpu.weight", posix_printf ("%d", std::clamp (limits.cpu_weight, 1, 10000)));
+  if (limits.io_weight)
+    ok = ok && cgroup_write (cgroup + "/io.weight", posix_printf ("default %d", std::clamp (limits.io_weight, 1, 10000)));
+  if (!ok) {
+    WEBHEAD_DEBUG ("%s: %s: controllers unavailable, using per process limits\n", __func__, cgroup.c_str());
+    rmdir (cgroup.c_str());
+    return "";
+  }
+  return cgroup;
+}
+
+/// Kill all processes left in `cgroup` and remove it.
+static void
+cgroup_remove (const std::string &cgroup)
+{
+  if (rmdir (cgroup.c_str()) == 0 || errno != EBUSY)
+    return;
+  // cgroup.kill needs Linux 5.14, rmdir is retried until the kernel has reaped the members
+  cgroup_write (cgroup + "/cgroup.kill", "1");
+  for (int i = 0; i < 100 && rmdir (cgroup.c_str()) != 0 && errno == EBUSY; i++)
+    usleep (1000);
+}
+
+// == Code cache ==
+#ifndef FICLONE
+#define FICLONE         _IOW (0x94, 9, int)     // Linux 4.5
+#endif
+
+/// Copy `src` to the new file `dst`, sharing extents via reflink where the file system supports it.
+static bool
+copy_file_clone (const std::string &src, const std::string &dst)
+{
+  const int in = open (src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return false;
+  const int out = open (dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  bool ok = out >= 0 && ioctl (out, FICLONE, in) == 0;
+  if (out >= 0 && !ok) {
+    // no reflink support, copy in kernel space
+    ssize_t n;
+    do
+      n = copy_file_range (in, nullptr, out, nullptr, 1024 * 1024 * 1024, 0);
+    while (n > 0 || (n < 0 && errno == EINTR));
+    ok = n == 0;
+    // copy_file_range() fails across file systems (e.g. disk to tmpfs) on most kernels, the offsets continue where it stopped
+    if (n < 0 && (errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)) {
+      char buffer[65536];
+      ssize_t r;
+      do {
+        r = read (in, buffer, sizeof (buffer));
+        for (ssize_t w = 0, done = 0; r > 0 && done < r; done += w) {
+          w = write (out, buffer + done, r - done);
+          if (w < 0 && errno != EINTR) {
+            r = -1;
+            break;
+          }
+          w = std::max (w, ssize_t (0));
+        }
+      } while (r > 0 || (r < 0 && errno == EINTR));
+      ok = r == 0;
+    }
+  }
+  close (in);
+  if (out >= 0) close (out);
+  if (out >= 0 && !ok)
+    unlink (dst.c_str());
+  return ok;
+}
+
+/// Copy the directory tree `src` to the new directory `dst`, returns the number of files copied.
+/// The copy is made next to `dst` and renamed into place, so `dst` is complete or missing (and 0 is returned).
+static size_t
+copy_tree (const std::string &src, const std::string &dst)
+{
+  namespace fs = std::filesystem;
+  static std::atomic<uint64_t> counter = 0;
+  const std::string tmpdir = dst + posix_printf (".copy-%u-%llu", getpid(), (long long unsigned) counter++);
   std::error_code ec{};
-  pp->child = bp::child (executable, bp::args (args), (bp::std_err & bp::std_out) > logfile, bp::std_in < bp::null, env, ec);
-  errno = ec.value();
-  return pp;
+  size_t files = 0;
+  bool ok = path_mkdirs (tmpdir);
+  for (fs::recursive_directory_iterator it (src, ec), end; ok && !ec && it != end; it.increment (ec)) {
+    const fs::path target = fs::path (tmpdir) / fs::relative (it->path(), src, ec);
+    if (it->is_directory (ec))
+      ok = path_mkdirs (target);
+    else if (it->is_regular_file (ec)) {
+      ok = copy_file_clone (it->path(), target);
+      files += ok;
+    }
+  }
+  ok = ok && !ec && rename (tmpdir.c_str(), dst.c_str()) == 0;
+  if (!ok) {
+    std::error_code ignored{};
+    fs::remove_all (tmpdir, ignored);
+    WEBHEAD_DEBUG ("%s: %s: failed to copy: %s\n", __func__, src.c_str(), ec ? ec.message().c_str() : strerror (errno));
+  }
+  return ok ? files : 0;
+}
+
+/// Reduce `appname` to a single path component, e.g. the absolute default_appname() to "<basename>-<hash>".
+static std::string
+appname_component (const std::string &appname)
+{
+  std::string name = std::filesystem::path (appname).filename();
+  if (name == appname && name != "." && name != "..")
+    return name;
+  // apps with the same basename in different locations get separate directories
+  if (name.empty() || name == "." || name == "..")
+    name = "app";
+  return name + posix_printf ("-%08x", Bundle::hash (appname, 0));
+}
+
+/// Compiled code and shader caches of a profile, kept per app and browser version under $XDG_CACHE_HOME/WebHead/CodeCache.
+struct CodeCache {
+  std::string              store;       // "" if disabled
+  std::string              profile;
+  std::vector<std::string> dirs;        // cache directories relative to the profile
+  /// Set up the store for `browser` and `appname` and purge stores of other versions.
+  CodeCache (const BrowserInfo &browser, const std::string &appname, const std::string &pdir);
+  CodeCache () = default;
+  size_t seed    () const;
+  bool   harvest () const;
+};
+
+CodeCache::CodeCache (const BrowserInfo &browser, const std::string &appname, const std::string &pdir)
+{
+  namespace fs = std::filesystem;
+  switch (browser.type)
+    {
+    case BrowserType::Chromium:
+    case BrowserType::GoogleChrome:
+      // V8 code cache and GPU program caches, everything else in the profile is discarded
+      dirs = { "Default/Code Cache", "Default/GPUCache", "GrShaderCache", "GraphiteDawnCache", "ShaderCache" };
+      break;
+    case BrowserType::Firefox:
+      dirs = { "startupCache", "shader-cache" };
+      break;
+    case BrowserType::Epiphany:         // WebKitGTK keeps its caches outside of the profile
+    case BrowserType::Any:
+      return;
+    }
+  std::string version = browser.version;
+  std::replace (version.begin(), version.end(), '/', '_');
+  if (version.empty())
+    return;
+  // stores are kept per installation, so two installed versions of a browser do not purge each other
+  std::error_code ec{};
+  const std::string prefix = fs::path (browser.executable).filename().string() +
+                             posix_printf ("-%08x-", Bundle::hash (fs::weakly_canonical (browser.executable, ec).string(), 0));
+  const fs::path appdir = fs::path (cache_home()) / "WebHead" / "CodeCache" / appname_component (appname);
+  // caches are only valid for the exact browser version
+  for (fs::directory_iterator it (appdir, ec), end; !ec && it != end; it.increment (ec)) {
+    const std::string name = it->path().filename();
+    // leftovers of harvest() in sessions that crashed
+    const size_t mark = name.rfind (name[0] == '.' ? ".harvest-" : ".trash-");
+    const pid_t pid = mark == std::string::npos ? 0 : atoi (name.c_str() + name.find ('-', mark) + 1);
+    const bool stale = pid > 0 && ::kill (pid, 0) == -1 && errno == ESRCH;
+    if (stale || (name.compare (0, prefix.size(), prefix) == 0 && name != prefix + version && mark == std::string::npos)) {
+      std::error_code ignored{};
+      fs::remove_all (it->path(), ignored);
+    }
+  }
+  store = appdir / (prefix + version);
+  profile = pdir;
+}
+
+/// Copy the stored caches into the fresh profile, returns the number of files.
+size_t
+CodeCache::seed () const
+{
+  namespace fs = std::filesystem;
+  size_t files = 0;
+  for (const std::string &dir : dirs)
+    if (!store.empty() && path_exists (fs::path (store) / dir))
+      files += copy_tree (fs::path (store) / dir, fs::path (profile) / dir);
+  WEBHEAD_DEBUG ("%s: %s: %zu files\n", __func__, store.c_str(), files);
+  return files;
+}
+
+/// Replace the store with the caches of the profile, after the browser exited cleanly.
+bool
+CodeCache::harvest () const
+{
+  namespace fs = std::filesystem;
+  if (store.empty())
+    return false;
+  static std::atomic<uint64_t> counter = 0;
+  const std::string suffix = posix_printf ("-%u-%llu", getpid(), (long long unsigned) counter++);
+  const std::string staging = fs::path (store).parent_path() / (".harvest" + suffix);
+  bool harvested = false, failed = false;
+  for (const std::string &dir : dirs) {
+    const fs::path src = fs::path (profile) / dir, dst = fs::path (staging) / dir;
+    if (!path_exists (src))
+      continue;
+    // the profile is discarded, so moving beats copying, e.g. from tmpfs profiles
+    if (path_mkdirs (dst.parent_path()) && (rename (src.c_str(), dst.c_str()) == 0 || (errno == EXDEV && copy_tree (src, dst))))
+      harvested = true;
+    else
+      failed = true;
+  }
+  harvested = harvested && !failed;
+  std::error_code ignored{};
+  if (harvested) {
+    // staging is complete, copy_tree() only renames finished copies into it, the swap leaves the old store or none
+    const std::string trash = store + ".trash" + suffix;
+    if (rename (store.c_str(), trash.c_str()) != 0 && errno != ENOENT)
+      harvested = false;
+    else if (rename (staging.c_str(), store.c_str()) != 0)
+      harvested = false;        // another session harvested meanwhile
+    fs::remove_all (trash, ignored);
+  }
+  fs::remove_all (staging, ignored);
+  WEBHEAD_DEBUG ("%s: %s: %s\n", __func__, store.c_str(), harvested ? "updated" : "unchanged");
+  return harvested;
+}
+
+// == Log capture ==
+/// Guess the severity of a browser log line from Chromium, Firefox and GLib message prefixes.
+static LogSeverity
+log_severity (const std::string &line)
+{
+  struct Marker { const char *text; LogSeverity severity; };
+  static const Marker markers[] = {
+    { ":FATAL:", LogSeverity::Fatal },          // Chromium: [pid:tid:MMDD/HHMMSS.uuuuuu:FATAL:file.cc(123)]
+    { "-ERROR **", LogSeverity::Fatal },        // GLib: (epiphany:pid): Gtk-ERROR **: aborts
+    { ":ERROR:", LogSeverity::Error },
+    { "-CRITICAL **", LogSeverity::Error },
+    { "###!!! ASSERTION", LogSeverity::Error }, // Firefox: [Parent pid, Main Thread] ###!!! ASSERTION
+    { "JavaScript error:", LogSeverity::Error },
+    { ":WARNING:", LogSeverity::Warning },
+    { "-WARNING **", LogSeverity::Warning },
+    { "] WARNING:", LogSeverity::Warning },
+    { "JavaScript warning:", LogSeverity::Warning },
+    { ":VERBOSE", LogSeverity::Verbose },
+    { "-DEBUG:", LogSeverity::Verbose },
+    { "]: D/", LogSeverity::Verbose },         // Firefox MOZ_LOG
+    { "]: V/", LogSeverity::Verbose },
+  };
+  // only the prefix is checked, messages may quote anything
+  const std::string_view prefix = std::string_view (line).substr (0, 160);
+  for (const Marker &marker : markers)
+    if (prefix.find (marker.text) != std::string_view::npos)
+      return marker.severity;
+  return LogSeverity::Info;
+}
+
+/// Ring buffer for browser output read from a nonblocking pipe, see LogOptions.
+class LogCapture {
+  const LogOptions     options_;
+  mutable std::mutex   mutex_;
+  std::deque<LogLine>  lines_;          // guarded by mutex_
+  size_t               bytes_ = 0;      // guarded by mutex_
+  // only used from the reading thread
+  std::string          partial_;
+  uint64_t             window_ = 0;     // start of the current rate limit second
+  int                  passed_ = 0;
+  size_t               suppressed_ = 0;
+  int                  persistfd_ = -1;
+  size_t               persisted_ = 0;
+  void add     (std::string text);
+  void split   (size_t keep);
+  void publish (const LogLine &line);
+  void persist (const LogLine &line);
+public:
+  const int fd;                         // read end of the pipe
+  explicit LogCapture (const LogOptions &options, int readfd);
+  /*dtor*/ ~LogCapture ();
+  ssize_t  read_input ();
+  void     finish     ();
+  std::vector<LogLine> lines (LogSeverity min_severity) const;
+};
+
+LogCapture::LogCapture (const LogOptions &options, int readfd) :
+  options_ (options), fd (readfd)
+{
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  if (!options_.persist.empty()) {
+    persistfd_ = open (options_.persist.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st = {};
+    if (persistfd_ >= 0 && fstat (persistfd_, &st) == 0)
+      persisted_ = st.st_size;
+  }
+}
+
+LogCapture::~LogCapture()
+{
+  close (fd);
+  if (persistfd_ >= 0)
+    close (persistfd_);
+}
+
+/// Read available output, returns the number of bytes read, 0 if the pipe is drained and -1 at EOF.
+ssize_t
+LogCapture::read_input ()
+{
+  char buffer[65536];
+  ssize_t total = 0;
+  while (true) {
+    const ssize_t n = read (fd, buffer, sizeof (buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      return total;
+    if (n <= 0)
+      return total ? total : -1;
+    total += n;
+    size_t start = 0;
+    for (const char *nl = (const char*) memchr (buffer, '\n', n); nl; nl = (const char*) memchr (buffer + start, '\n', n - start)) {
+      partial_.append (buffer + start, nl - (buffer + start));
+      split (std::max (options_.max_line, size_t (1)));
+      add (std::move (partial_));
+      partial_.clear();
+      start = nl + 1 - buffer;
+    }
+    partial_.append (buffer + start, n - start);
+    split (std::max (options_.max_line, size_t (1)) - 1);
+  }
+}
+
+/// Add `max_line` sized pieces from the start of the current line while it is longer than `keep`.
+void
+LogCapture::split (size_t keep)
+{
+  const size_t max_line = std::max (options_.max_line, size_t (1));
+  while (partial_.size() > keep) {
+    add (partial_.substr (0, max_line));
+    partial_.erase (0, max_line);
+  }
+}
+
+/// Add an unterminated last line and report lines still held back by the rate limit.
+void
+LogCapture::finish ()
+{
+  if (!partial_.empty())
+    add (std::move (partial_));
+  partial_.clear();
+  if (suppressed_)
+    publish (LogLine { timestamp_monotonic(), LogSeverity::Warning, posix_printf ("webhead: %zu lines suppressed", suppressed_) });
+  suppressed_ = 0;
+}
+
+/// Store `text` in the ring buffer and pass it on if it passes the severity filter and rate limit.
+void
+LogCapture::add (std::string text)
+{
+  if (!text.empty() && text.back() == '\r')
+    text.pop_back();
+  LogLine line { timestamp_monotonic(), log_severity (text), std::move (text) };
+  const bool wanted = line.severity >= options_.min_severity && (options_.on_line || persistfd_ >= 0);
+  {
+    std::lock_guard<std::mutex> lock (mutex_);
+    lines_.push_back (line);
+    bytes_ += sizeof (LogLine) + lines_.back().text.size();
+    while (bytes_ > options_.buffer_bytes && !lines_.empty()) {
+      bytes_ -= sizeof (LogLine) + lines_.front().text.size();
+      lines_.pop_front();
+    }
+  }
+  if (!wanted)
+    return;
+  if (options_.max_lines_per_sec > 0) {
+    if (line.stamp - window_ >= 1000000) {
+      window_ = line.stamp;
+      passed_ = 0;
+      if (suppressed_)
+        publish (LogLine { line.stamp, LogSeverity::Warning, posix_printf ("webhead: %zu lines suppressed", suppressed_) });
+      suppressed_ = 0;
+    }
+    if (passed_ >= options_.max_lines_per_sec) {
+      suppressed_ += 1;
+      return;
+    }
+    passed_ += 1;
+  }
+  publish (line);
+}
+
+/// Persist `line` and call the on_line callback.
+void
+LogCapture::publish (const LogLine &line)
+{
+  if (persistfd_ >= 0)
+    persist (line);
+  if (options_.on_line)
+    options_.on_line (line);
+}
+
+/// Append `line` to the persist file, rotating it once it exceeds persist_bytes.
+void
+LogCapture::persist (const LogLine &line)
+{
+  const std::string text = line.text + "\n";
+  if (write (persistfd_, text.data(), text.size()) < 0) {}
+  persisted_ += text.size();
+  if (persisted_ < options_.persist_bytes)
+    return;
+  close (persistfd_);
+  const std::string &path = options_.persist;
+  for (int i = options_.persist_files; i > 1; i--)
+    rename ((path + "." + std::to_string (i - 1)).c_str(), (path + "." + std::to_string (i)).c_str());
+  if (options_.persist_files > 0)
+    rename (path.c_str(), (path + ".1").c_str());
+  persistfd_ = open (path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  persisted_ = 0;
+}
+
+/// Copy the buffered lines at or above `min_severity`.
+std::vector<LogLine>
+LogCapture::lines (LogSeverity min_severity) const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  std::vector<LogLine> result;
+  for (const LogLine &line : lines_)
+    if (line.severity >= min_severity)
+      result.push_back (line);
+  return result;
+}
+
+/// Session::Process wraps ChildProcess and tracks the session phases.
+struct Session::Process {
+  ChildProcess          child;
+  std::mutex            mutex;
+  SessionStats          stats;
+  std::string           tracefile;
+  std::function<void (SessionPhase, const SessionStats&)> on_phase;
+  std::function<void (int)> on_exit;
+  std::thread           monitor;
+  int                   wakefds[2] = { -1, -1 };
+  int                   pidfd = -1;
+  ChildSetup            setup;          // consumed by the start_*() functions
+  std::string           cgroup;         // cgroup v2 directory of the web head, see ResourceLimits
+  CdpPipeP              cdp;
+  std::shared_ptr<BrowserHost::Impl> host; // set for windows of a shared browser, see BrowserHost
+  std::string           window_tag, target_id;
+  bool                  window_open = false;
+  std::function<void (const std::string&)> release_window; // called with the target of a window that is still open
+  std::thread           sampler;
+  std::condition_variable sampler_cond;
+  std::shared_ptr<bool> sampler_quit;  // per sampler thread, guarded by mutex
+  LogOptions            log_options;
+  std::shared_ptr<LogCapture> log;      // set if log_options.capture, read by the monitor thread
+  CodeCache             code_cache;     // harvested by the monitor thread after a clean exit
+  BrowserInfo           cost_browser;   // set if SessionOptions::record_costs, recorded by the monitor thread
+  bool                  cost_by_request = false; // ready means the first HTTP request, not the first output
+  size_t                cost_rss = 0;   // steady-state RSS, sampled by the monitor thread
+  bool                  standby = false; // guarded by mutex, see Session::start_standby()
+  std::function<void (const std::string&)> standby_navigate; // moves the standby page to the session URL
+  std::function<void()> release_standby; // removes the bootstrap page routes
+  std::thread           standby_timer;
+  std::mutex            shutdown_mutex; // serializes shutdown() calls, e.g. of the standby timer and the user
+  std::atomic<std::thread::id> monitor_id; // set by monitor_loop(), `monitor` itself may be joined concurrently
+  std::condition_variable standby_cond;
+  ~Process();
+  void standby_wait    (int timeout_ms);
+  int  cost_poll       ();
+  void record_cost     ();
+  bool leave_standby   ();
+  bool redirect_output (const std::string &logfile);
+  void phase         (SessionPhase phase, uint64_t stamp = 0);
+  void window_closed (int exit_code);
+  void signal_all    (int signal);
+  int  shutdown      (int timeout_ms);
+  void sample_loop   (pid_t root, std::string cgroup, SampleOptions options, std::function<void (const ResourceSample&)> callback,
+                      std::shared_ptr<bool> quit);
+  void stop_sampler  ();
+  void open_trace    (const std::string &filename);
+  void start_monitor (const std::string &logfile);
+  void monitor_loop  (int inotifyfd);
+};
+
+/// Timestamp field of `phase` in `stats`.
+static uint64_t&
+phase_stamp (SessionStats &stats, SessionPhase phase)
+{
+  uint64_t *const stamps[] = { &stats.start, &stats.discovery_end, &stats.tempdir, &stats.profile, &stats.spawn,
+                               &stats.first_log, &stats.first_request, &stats.exit };
+  return *stamps[size_t (phase)];
+}
+
+/// Format a WebHead.trace line for `phase`.
+static std::string
+phase_trace_line (SessionStats stats, SessionPhase phase)
+{
+  static const char *const names[] = { "start", "discovery", "tempdir", "profile", "spawn", "first_log", "first_request", "exit" };
+  if (phase == SessionPhase::Start)
+    return posix_printf ("# WebHead trace, CLOCK_MONOTONIC µs\nstart\t%llu\n", (long long unsigned) stats.start);
+  const uint64_t stamp = phase_stamp (stats, phase);
+  if (phase == SessionPhase::Exit)
+    return posix_printf ("%s\t%+lld\t%d\n", names[size_t (phase)], (long long) (stamp - stats.start), stats.exit_code);
+  return posix_printf ("%s\t%+lld\n", names[size_t (phase)], (long long) (stamp - stats.start));
+}
+
+/// Start writing WebHead.trace, including all phases recorded so far.
+void
+Session::Process::open_trace (const std::string &filename)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  tracefile = filename;
+  std::string lines;
+  for (size_t p = size_t (SessionPhase::Start); p <= size_t (SessionPhase::Exit); p++)
+    if (phase_stamp (stats, SessionPhase (p)))
+      lines += phase_trace_line (stats, SessionPhase (p));
+  write_string (tracefile, lines);
+}
+
+/// Record `phase` in stats and trace file, then notify the on_phase callback.
+void
+Session::Process::phase (SessionPhase phase, uint64_t stamp)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  uint64_t &slot = phase_stamp (stats, phase);
+  if (slot) return;     // phases are recorded once
+  slot = stamp ? stamp : timestamp_monotonic();
+  const SessionStats copy = stats;
+  if (!tracefile.empty()) {
+    const std::string line = phase_trace_line (copy, phase);
+    const int fd = open (tracefile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      if (write (fd, line.data(), line.size()) < 0) {}
+      close (fd);
+    }
+  }
+  lock.unlock();
+  if (on_phase)
+    on_phase (phase, copy);
+}
+
+/// Let the browser write to `logfile`, or into a LogCapture if log_options.capture is set.
+bool
+Session::Process::redirect_output (const std::string &logfile)
+{
+  if (!log_options.capture)
+    return setup.redirect ("/dev/null", logfile);
+  int fds[2] = { -1, -1 };
+  if (pipe2 (fds, O_CLOEXEC) != 0)
+    return false;
+  log = std::make_shared<LogCapture> (log_options, fds[0]);
+  return setup.redirect ("/dev/null", fds[1]);
+}
+
+/// Watch WebHead.log (or the LogCapture pipe) and the process exit, see monitor_loop().
+void
+Session::Process::start_monitor (const std::string &logfile)
+{
+  pidfd = child.pidfd() >= 0 ? fcntl (child.pidfd(), F_DUPFD_CLOEXEC, 0) : pidfd_open (child.id());
+  const int inotifyfd = log ? -1 : inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (inotifyfd >= 0) {
+    struct stat st = {};
+    if (stat (logfile.c_str(), &st) == 0 && st.st_size > 0)
+      phase (SessionPhase::FirstLog);
+    else
+      inotify_add_watch (inotifyfd, logfile.c_str(), IN_MODIFY);
+  }
+  if (pipe2 (wakefds, O_CLOEXEC) != 0)
+    wakefds[0] = wakefds[1] = -1;
+  monitor = std::thread (&Process::monitor_loop, this, inotifyfd);
+}
+
+/// Record first log output and exit of the web head without reaping it, and read captured output.
+void
+Session::Process::monitor_loop (int inotifyfd)
+{
+  monitor_id = std::this_thread::get_id();
+  const pid_t pid = child.id();
+  bool waiting_for_log;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    waiting_for_log = inotifyfd >= 0 && !stats.first_log;
+  }
+  int logfd = log ? log->fd : -1;
+  while (true) {
+    struct pollfd pfds[4] = { { wakefds[0], POLLIN, 0 }, { inotifyfd, POLLIN, 0 }, { pidfd, POLLIN, 0 }, { logfd, POLLIN, 0 } };
+    pfds[1].fd = waiting_for_log ? inotifyfd : -1;
+    // without pidfd support, fall back to checking once per second
+    int timeout_ms = pidfd >= 0 ? -1 : 1000;
+    if (!cost_browser.executable.empty()) {
+      const int due_ms = cost_poll();
+      timeout_ms = due_ms < 0 || timeout_ms < 0 ? std::max (due_ms, timeout_ms) : std::min (due_ms, timeout_ms);
+    }
+    const int n = poll (pfds, 4, timeout_ms);
+    if (n < 0 && errno != EINTR)
+      break;
+    if (pfds[0].revents)
+      break;
+    if (pfds[1].revents) {
+      char buffer[4096];
+      while (read (inotifyfd, buffer, sizeof (buffer)) > 0) {}
+      phase (SessionPhase::FirstLog);
+      waiting_for_log = false;
+    }
+    if (pfds[3].revents) {
+      const ssize_t bytes = log->read_input();
+      if (bytes > 0)
+        phase (SessionPhase::FirstLog);
+      else if (bytes < 0) {
+        log->finish();  // EOF, all writers are gone
+        logfd = -1;
+      }
+    }
+    siginfo_t info = {};
+    if (waitid (P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+      if (logfd >= 0) {
+        while (log->read_input() > 0) {}
+        log->finish();
+      }
+      // WNOWAIT leaves reaping to ChildProcess
+      const int exit_code = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stats.exit_code = exit_code;
+      }
+      // helpers must not outlive the browser, the zombie keeps its PID from being reused meanwhile
+      signal_all (SIGKILL);
+      if (exit_code == 0)
+        code_cache.harvest();
+      if (!cost_browser.executable.empty())
+        record_cost();
+      phase (SessionPhase::Exit);
+      if (on_exit)
+        on_exit (exit_code);
+      break;
+    }
+  }
+  if (inotifyfd >= 0) close (inotifyfd);
+}
+
+/// Record the exit of a shared browser window and wake up exit_fd() watchers.
+void
+Session::Process::window_closed (int exit_code)
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (!window_open) return;
+    window_open = false;
+    stats.exit_code = exit_code;
+  }
+  phase (SessionPhase::Exit);
+  const uint64_t one = 1;
+  if (pidfd >= 0 && write (pidfd, &one, sizeof (one)) < 0) {}
+  if (on_exit)
+    on_exit (exit_code);
+}
+
+/// Sample the steady-state RSS once it is due, returns the ms until then or -1 if nothing is left to do.
+int
+Session::Process::cost_poll ()
+{
+  if (cost_rss)
+    return -1;
+  uint64_t ready;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    ready = cost_by_request ? stats.first_request : stats.first_log;
+  }
+  if (!ready)
+    return 1000;        // the first request is recorded by the HttpServer thread, check back later
+  const uint64_t due = ready + browser_cost_settle_ms * 1000ULL, now = timestamp_monotonic();
+  if (now < due)
+    return (due - now + 999) / 1000;
+  cost_rss = sample_process_tree (child.id(), cgroup, SampleOptions()).rss;
+  cost_rss = std::max (cost_rss, size_t (1));   // sampled, even if the tree is gone
+  return -1;
+}
+
+/// Add launch time and steady-state RSS of an exited web head to the BrowserCost history.
+void
+Session::Process::record_cost ()
+{
+  uint64_t start, ready;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    start = stats.start;
+    ready = cost_by_request ? stats.first_request : stats.first_log;
+  }
+  if (ready > start)
+    browser_cost_record (cost_browser, (ready - start) / 1000.0, cost_rss > 1 ? cost_rss : 0);
+}
+
+/// Kill the web head if it is still on standby after `timeout_ms`.
+void
+Session::Process::standby_wait (int timeout_ms)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  if (standby_cond.wait_for (lock, std::chrono::milliseconds (timeout_ms), [this] () { return !standby; }))
+    return;
+  standby = false;
+  lock.unlock();
+  WEBHEAD_DEBUG ("%s: reclaiming unused standby web head: pid=%d\n", __func__, child.id());
+  shutdown (0);
+  if (release_standby)
+    release_standby();
+}
+
+/// Leave standby and join the timer thread, returns false if the web head was not (or no longer) on standby.
+bool
+Session::Process::leave_standby ()
+{
+  bool was_standby;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    was_standby = standby;
+    standby = false;
+  }
+  standby_cond.notify_all();
+  if (standby_timer.joinable())
+    standby_timer.join();
+  return was_standby;
+}
+
+/// Pass a sample of the process tree under `root` (or in `cgroup`) to `callback` every `options.interval_ms` until the web head exits.
+void
+Session::Process::sample_loop (pid_t root, std::string cgroup, SampleOptions options, std::function<void (const ResourceSample&)> callback,
+                               std::shared_ptr<bool> quit)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  while (!*quit && !stats.exit) {
+    lock.unlock();
+    const ResourceSample sample = sample_process_tree (root, cgroup, options);
+    if (sample.processes)
+      callback (sample);
+    lock.lock();
+    if (!sample.processes)
+      break;
+    sampler_cond.wait_for (lock, std::chrono::milliseconds (std::max (options.interval_ms, 1)), [&quit] () { return *quit; });
+  }
+}
+
+/// Stop and join the sampling thread, see Session::start_sampling().
+void
+Session::Process::stop_sampler ()
+{
+  if (!sampler.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    *sampler_quit = true;
+    sampler_quit = nullptr;
+  }
+  sampler_cond.notify_all();
+  if (sampler.get_id() == std::this_thread::get_id())
+    sampler.detach();           // stopped from the callback, the loop exits after it returns
+  else
+    sampler.join();
+}
+
+/// Send `signal` to all processes of the web head, via its process group and cgroup.
+void
+Session::Process::signal_all (int signal)
+{
+  const pid_t pid = child.id();
+  if (::kill (-pid, signal) != 0)
+    ::kill (pid, signal);       // not a group leader
+  if (signal == SIGKILL && !cgroup.empty())
+    cgroup_write (cgroup + "/cgroup.kill", "1");
+}
+
+/// Send SIGTERM to all processes of the web head, SIGKILL after `timeout_ms` or right away if 0, then reap it.
+/// Returns ETIMEDOUT if SIGTERM was not sufficient, ESRCH if the web head was already reaped.
+int
+Session::Process::shutdown (int timeout_ms)
+{
+  // concurrent callers wait for the first, which joins the monitor and reaps the child
+  std::unique_lock<std::mutex> lock (shutdown_mutex, std::defer_lock);
+  if (monitor_id == std::this_thread::get_id()) {
+    // called from on_exit, a shutdown in progress is joining this thread
+    if (!lock.try_lock())
+      return ESRCH;
+  } else
+    lock.lock();
+  if (!child.valid() || child.reaped())
+    return ESRCH;
+  const pid_t pid = child.id();
+  // a reaped child may have lent its PID to an unrelated process group
+  siginfo_t info = {};
+  if (waitid (P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0)
+    return ESRCH;
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds (std::max (timeout_ms, 0));
+  int err = 0;
+  if (timeout_ms > 0)
+    signal_all (SIGTERM);
+  if (timeout_ms <= 0 || !wait_exit (pid, timeout_ms)) {
+    signal_all (SIGKILL);
+    wait_exit (pid, -1);
+    err = timeout_ms > 0 ? ETIMEDOUT : 0;
+  }
+  // let the monitor record the exit before the child is reaped
+  if (monitor.joinable() && monitor.get_id() != std::this_thread::get_id())
+    monitor.join();
+  child.wait();
+  // helpers are not our children, poll for them with backoff until the deadline
+  for (useconds_t delay = 1000; process_group_alive (pid, cgroup) && std::chrono::steady_clock::now() < deadline; delay = std::min (delay * 2, 50000u))
+    usleep (delay);
+  if (process_group_alive (pid, cgroup)) {
+    signal_all (SIGKILL);
+    err = timeout_ms > 0 ? ETIMEDOUT : 0;
+  }
+  return err;
+}
+
+/// Stop monitoring, the web head and its helpers are killed if still running.
+Session::Process::~Process()
+{
+  leave_standby();
+  if (release_standby)
+    release_standby();
+  stop_sampler();
+  if (release_window)
+    release_window (window_open ? target_id : "");
+  if (monitor.joinable()) {
+    if (wakefds[1] >= 0 && write (wakefds[1], "", 1) < 0) {}
+    if (monitor.get_id() == std::this_thread::get_id())
+      monitor.detach();         // released from on_exit, monitor_loop() is done with `this`
+    else
+      monitor.join();
+  }
+  if (wakefds[0] >= 0) close (wakefds[0]);
+  if (wakefds[1] >= 0) close (wakefds[1]);
+  if (pidfd >= 0) close (pidfd);
+  setup.release();
+  // ChildProcess would only kill the browser itself
+  shutdown (0);
+  if (!cgroup.empty())
+    cgroup_remove (cgroup);
+}
+
+/// Write generic files to browser profile
+static void
+create_profile_files (const std::string &profiledir, const std::string &exename, bool snapdir, const std::string appname)
+{
+  namespace fs = std::filesystem;
+  const auto s =
+    posix_printf ("WebHead directory to host temporary profile:\n\nApplication=%s\nWebHead=%s\n", appname.c_str(), exename.c_str());
+  write_string (fs::path (profiledir) / "WebHead.txt", s);
+}
+
+/// Create profile for chromium type browsers
+static std::string
+create_chromium_profile (const std::string &executable, bool snapdir, const std::string appname, const ProfilePlacement &placement,
+                         uint64_t *tempdir_stamp)
+{
+  namespace fs = std::filesystem;
+  const std::string exename = fs::path (executable).filename();
+  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir, placement);
+  if (pdir == "") return "";
+  if (tempdir_stamp)
+    *tempdir_stamp = timestamp_monotonic();
+  create_profile_files (pdir, exename, snapdir, appname);
+  return pdir;
+}
+
+/// Command line for chromium type browsers
+static std::vector<std::string>
+chromium_args (const std::string &pdir, const std::string &url, const std::vector<std::string> &extra_args, bool incognito = true)
+{
+  // https://www.chromium.org/developers/how-tos/run-chromium-with-flags/
+  // https://peter.sh/experiments/chromium-command-line-switches/
+  std::vector<std::string> args = {
+    "--user-data-dir=" + pdir,          // Avoids "Opening in existing browser session"
+    "--no-first-run",                   // Avoid popup for empty profile
+    "--no-experiments",
+    "--no-default-browser-check",
+    "--disable-extensions",
+    "--disable-sync",
+    "--bwsi",
+    "--new-window",
+  };
+  // incognito keeps the code cache in memory, the profile is discarded either way
+  if (incognito)
+    args.insert (args.begin() + 1, "--incognito");
+  args.insert (args.end(), extra_args.begin(), extra_args.end());
+  args.push_back ("--app=" + url);
+  return args;
+}
+
+/// Start chromium type browsers
+static Session::ProcessP
+start_chromium (Session::ProcessP pp, const std::string &executable, const std::string &pdir, const std::string &url, const std::string appname,
+                const std::vector<std::string> &extra_args)
+{
+  namespace fs = std::filesystem;
+  const std::string logfile = fs::path (pdir) / "WebHead.log";
+  const std::vector<std::string> args = chromium_args (pdir, url, extra_args, pp->code_cache.store.empty());
+  WEBHEAD_DEBUG ("%s: %s %s\n", __func__, executable.c_str(), string_join (" ", args).c_str());
+  errno = pp->redirect_output (logfile) ? pp->child.spawn (executable, args, pp->setup) : errno;
+  pp->setup.release();
+  return pp;
+}
+
+/// Start chromium type browsers with a CdpPipe connected to --remote-debugging-pipe
+static Session::ProcessP
+start_chromium_cdp (Session::ProcessP pp, const std::string &executable, const std::string &pdir, const std::string &url, const std::string appname,
+                    std::vector<std::string> extra_args)
+{
+  // the browser reads commands from fd 3 and writes replies to fd 4
+  int commands[2] = { -1, -1 }, replies[2] = { -1, -1 };
+  if (pipe2 (commands, O_CLOEXEC) == 0 && pipe2 (replies, O_CLOEXEC) != 0) {
+    // start without --remote-debugging-pipe
+    close (commands[0]);
+    close (commands[1]);
+    commands[0] = commands[1] = replies[0] = replies[1] = -1;
+  }
+  if (commands[0] >= 0 && replies[0] >= 0) {
+    // move child ends above the target fds, so dup2() cannot clobber them
+    pp->setup.fds = { { child_fd (commands[0]), 3 }, { child_fd (replies[1]), 4 } };
+    extra_args.push_back ("--remote-debugging-pipe");
+  }
+  start_chromium (pp, executable, pdir, url, appname, extra_args);
+  const int last = errno;
+  if (pp->child.valid() && commands[1] >= 0 && replies[0] >= 0)
+    pp->cdp = std::make_shared<CdpPipe> (commands[1], replies[0]);
+  else
+    for (int fd : { commands[1], replies[0] })
+      if (fd >= 0) close (fd);
+  errno = last;
+  return pp;
+}
+
+/// Create profile for the Epiphany browser
+static std::string
+create_epiphany_profile (const std::string &executable, bool snapdir, const std::string appname, const ProfilePlacement &placement,
+                         uint64_t *tempdir_stamp)
+{
+  namespace fs = std::filesystem;
+  const std::string exename = fs::path (executable).filename();
+  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir, placement);
+  if (pdir == "") return "";
+  if (tempdir_stamp)
+    *tempdir_stamp = timestamp_monotonic();
+  const fs::path applications = fs::path (pdir) / "applications";
+  if (!path_mkdirs (applications)) return "";
+  create_profile_files (pdir, exename, snapdir, appname);
+  // epiphany --application-mode needs a desktop file
+  const fs::path desktopfile = applications / (appname + ".desktop");
+  const std::string desktopentry =
+    "[Desktop Entry]\nVersion=1.0\nType=Application\nStartupNotify=true\nTerminal=false\n" +
+    posix_printf ("Exec=epiphany -a %s.desktop\n", appname.c_str()) +
+    posix_printf ("StartupWMClass=%s\n", appname.c_str()) +
+    posix_printf ("Name=%s\n", appname.c_str());
+  write_string (desktopfile, desktopentry);
+  return pdir;
+}
+
+/// Start the Epiphany browser
+static Session::ProcessP
+start_epiphany (Session::ProcessP pp, const std::string &executable, const std::string &pdir, const std::string &url, const std::string appname,
+                const std::vector<std::string> &extra_args)
+{
+  namespace fs = std::filesystem;
+  const std::string logfile = fs::path (pdir) / "WebHead.log";
+  // https://manpages.debian.org/unstable/epiphany-browser/epiphany.1.en.html
+  std::vector<std::string> args = {
+    "-a", appname + ".desktop",         // --application-mode avoids normal browser behaviour
+    // "--incognito",
+    "--new-window",
+  };
+  args.insert (args.end(), extra_args.begin(), extra_args.end());
+  args.push_back (url);
+  // extend $XDG_DATA_DIRS so epiphany can find {$XDG_DATA_DIRS}/applications/appname.desktop
+  const char *const XDG_DATA_DIRS = getenv ("XDG_DATA_DIRS");
+  const std::string xdg_data_dirs = !XDG_DATA_DIRS ? pdir : pdir + ":" + XDG_DATA_DIRS;
+  std::vector<std::string> env = { "XDG_DATA_DIRS=" + xdg_data_dirs };
+  for (char **var = environ; *var; var++)
+    if (strncmp (*var, "XDG_DATA_DIRS=", 14) != 0)
+      env.push_back (*var);
+  WEBHEAD_DEBUG ("%s: XDG_DATA_DIRS=\"%s\" %s %s\n", __func__, xdg_data_dirs.c_str(), executable.c_str(), string_join (" ", args).c_str());
+  errno = pp->redirect_output (logfile) ? pp->child.spawn (executable, args, pp->setup, &env) : errno;
+  pp->setup.release();
+  return pp;
+}
+
+/// Create profile for the Firefox browser
+static std::string
+create_firefox_profile (const std::string &executable, bool snapdir, const std::string appname, const ProfilePlacement &placement,
+                        uint64_t *tempdir_stamp)
+{
+  namespace fs = std::filesystem;
+  // Always start with a fresh profile
+  const std::string exename = fs::path (executable).filename();
+  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir, placement);
+  if (pdir == "") return "";
+  if (tempdir_stamp)
+    *tempdir_stamp = timestamp_monotonic();
+  const fs::path chrome = fs::path (pdir) / "chrome";
+  if (!path_mkdirs (chrome)) return "";
+  create_profile_files (pdir, exename, snapdir, appname);
+  // Suppress some browser behaviours and allow userChrome.css
+  const std::string prefs_content =
+    "user_pref(\"app.normandy.first_run\", false);\n"
+    "user_pref(\"doh-rollout.doneFirstRun\", true);\n"
+    "user_pref(\"browser.cache.disk.enable\", false);\n"
+    "user_pref(\"browser.shell.checkDefaultBrowser\", false);\n"
+    "user_pref(\"browser.discovery.enabled\", false);\n"
+    "user_pref(\"datareporting.healthreport.uploadEnabled\", false);\n"
+    "user_pref(\"layout.css.has-selector.enabled\", true);\n"
+    "user_pref(\"toolkit.legacyUserProfileCustomizations.stylesheets\", true);\n"
+    "user_pref(\"toolkit.telemetry.reportingpolicy.firstRun\", false);\n";
+  write_string (fs::path (pdir) / "prefs.js", prefs_content);
+  // Remove the most useless firefox chrome elements to serve as web head
+  // Debug: DevTools > … > Settings [F1] > [x]EnableRemoteDebugging [x]EnableBrowserChromeToolbox // Browser: Ctrl+Shift+Alt+I
+  const std::string userchrome_content =
+    // Hide buttons useless for web heads
+    "toolbar#nav-bar toolbarbutton#unified-extensions-button, toolbar#nav-bar toolbarbutton#save-to-pocket-button { display: none; }\n"
+    // Hide main menu items
+    // "toolbaritem#menubar-items { display: none; }\n"
+    // Hide useless browser notifications about telemtry
+    "#navigator-toolbox vbox.notificationbox-stack.global-notificationbox { display: none; }\n"
+    // Hide single tab toolbar, tabs stay usable with Ctrl+T Ctrl+W
+    "toolbar#TabsToolbar:has(tab:only-of-type) { visibility: collapse; }\n"
+    // Hide Bookmarks Bar
+    "toolbar#PersonalToolbar { display: none; }\n";
+  write_string (chrome / "userChrome.css", userchrome_content);
+  return pdir;
+}
+
+/// Start the Firefox browser
+static Session::ProcessP
+start_firefox (Session::ProcessP pp, const std::string &executable, const std::string &pdir, const std::string &url, const std::string appname,
+               const std::vector<std::string> &extra_args)
+{
+  namespace fs = std::filesystem;
+  // https://wiki.mozilla.org/Firefox/CommandLineOptions
+  std::vector<std::string> args = {
+    "--class=" + appname,
+    "--profile", pdir,          // enforce new seesion on each start
+    "--no-remote",
+    // "--kiosk",
+  };
+  args.insert (args.end(), extra_args.begin(), extra_args.end());
+  args.insert (args.end(), { "--private-window", url });
+  // Start and redirect stdin/stdout/stderr which may be used by the application
+  WEBHEAD_DEBUG ("%s: %s %s\n", __func__, executable.c_str(), string_join (" ", args).c_str());
+  const std::string logfile = fs::path (pdir) / "WebHead.log";
+  errno = pp->redirect_output (logfile) ? pp->child.spawn (executable, args, pp->setup) : errno;
+  pp->setup.release();
+  return pp;
+}
+
+/// Place the web head in a cgroup with `limits` or set up fallback limits, and derive browser settings.
+static void
+prepare_limits (Session::Process &pp, BrowserType type, const std::string &pdir, const ResourceLimits &limits,
+                std::vector<std::string> &extra_args)
+{
+  if (!limits.memory_high && !limits.memory_max && !limits.cpu_weight && !limits.io_weight &&
+      !limits.renderer_processes && !limits.js_heap_max)
+    return;
+  pp.cgroup = limits.cgroup ? cgroup_create (limits) : "";
+  if (!pp.cgroup.empty())
+    pp.setup.cgroup_procs = open ((pp.cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+  if (pp.setup.cgroup_procs < 0) {
+    // without delegation, weights map to nice levels (factor 1.25 per step) and IO priorities (factor 2 per level)
+    if (limits.cpu_weight > 0 && limits.cpu_weight < 100)
+      pp.setup.nice = std::min (19, int (std::lround (std::log (100.0 / limits.cpu_weight) / std::log (1.25))));
+    if (limits.io_weight > 0) {
+      const int IOPRIO_CLASS_BE = 2, IOPRIO_CLASS_SHIFT = 13;
+      const int level = std::clamp (4 - int (std::lround (std::log2 (limits.io_weight / 100.0))), 0, 7);
+      pp.setup.ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level;
+    }
+    // RLIMIT_DATA applies per process, not to the whole tree
+    pp.setup.rlimit_data = limits.memory_max;
+  }
+  // browser knobs, derived from the memory budget unless given
+  const size_t memory = limits.memory_max ? limits.memory_max : limits.memory_high;
+  const size_t MiB = 1024 * 1024;
+  const int renderers = limits.renderer_processes ? limits.renderer_processes :
+                        memory ? int (std::clamp<size_t> (memory / (256 * MiB), 1, 8)) : 0;
+  const size_t heap = limits.js_heap_max ? limits.js_heap_max : memory / 4;
+  switch (type)
+    {
+    case BrowserType::Chromium:
+    case BrowserType::GoogleChrome:
+      if (renderers)
+        extra_args.push_back (posix_printf ("--renderer-process-limit=%d", renderers));
+      if (heap)
+        extra_args.push_back (posix_printf ("--js-flags=--max-old-space-size=%zu", std::max<size_t> (heap / MiB, 16)));
+      break;
+    case BrowserType::Firefox:
+      if (renderers) {
+        const int fd = open ((std::filesystem::path (pdir) / "prefs.js").c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        const std::string pref = posix_printf ("user_pref(\"dom.ipc.processCount\", %d);\n", renderers);
+        if (fd >= 0) {
+          if (write (fd, pref.data(), pref.size()) < 0) {}
+          close (fd);
+        }
+      }
+      break;
+    case BrowserType::Epiphany:
+    case BrowserType::Any:
+      break;
+    }
+}
+
+/// Create a fresh profile directory with all files needed to start `browser`, returns "" on errors.
+static std::string
+create_profile (const BrowserInfo &browser, const std::string &appname, const ProfilePlacement &placement,
+                uint64_t *tempdir_stamp = nullptr)
+{
+  switch (browser.type)
+    {
+    case BrowserType::Chromium:
+    case BrowserType::GoogleChrome:
+      return create_chromium_profile (browser.executable, browser.snapdir, appname, placement, tempdir_stamp);
+    case BrowserType::Epiphany:
+      return create_epiphany_profile (browser.executable, browser.snapdir, appname, placement, tempdir_stamp);
+    case BrowserType::Firefox:
+      return create_firefox_profile (browser.executable, browser.snapdir, appname, placement, tempdir_stamp);
+    case BrowserType::Any:
+      errno = ENOSYS;
+      break;
+    }
+  return "";
+}
+
+/// Application name used for profiles if none is given.
+static std::string
+default_appname (const std::string &appname)
+{
+  if (!appname.empty())
+    return appname;
+  char buf[4096] = { 0, };
+  ssize_t n = ::readlink ("/proc/self/exe", buf, sizeof (buf) - 1);
+  return n > 0 ? buf : "/proc/self/";
+}
+
+// == ProfilePool ==
+/// Background thread and ready profile directories of a ProfilePool.
+struct ProfilePool::Impl {
+  struct Slot {
+    BrowserInfo browser;
+    std::string appname;
+    std::deque<std::string> ready;
+  };
+  const size_t            count;
+  const ProfilePlacement  placement;
+  std::mutex              mutex;
+  std::condition_variable cond;
+  std::vector<Slot>       slots;
+  bool                    quit = false;
+  std::thread             thread;
+  explicit
+  Impl (size_t n, const ProfilePlacement &p) :
+    count (n), placement (p)
+  {}
+  Slot*
+  find (const BrowserInfo &browser, const std::string &appname)
+  {
+    for (Slot &slot : slots)
+      if (slot.appname == appname && slot.browser.executable == browser.executable &&
+          slot.browser.type == browser.type && slot.browser.snapdir == browser.snapdir)
+        return &slot;
+    return nullptr;
+  }
+  void
+  refill_loop ()
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    while (!quit) {
+      Slot *needy = nullptr;
+      for (Slot &slot : slots)
+        if (slot.ready.size() < count)
+          needy = &slot;
+      if (!needy) {
+        cond.wait (lock);
+        continue;
+      }
+      const BrowserInfo browser = needy->browser;
+      const std::string appname = needy->appname;
+      lock.unlock();
+      const std::string pdir = create_profile (browser, appname, placement);
+      WEBHEAD_DEBUG ("ProfilePool: prepared: %s\n", pdir.c_str());
+      lock.lock();
+      Slot *slot = find (browser, appname);
+      if (pdir.empty()) {
+        // avoid spinning on persistent errors, claim() falls back to synchronous creation
+        cond.wait_for (lock, std::chrono::seconds (1));
+        continue;
+      }
+      if (slot && !quit)
+        slot->ready.push_back (pdir);
+      else {
+        std::error_code ec;
+        std::filesystem::remove_all (pdir, ec);
+      }
+    }
+  }
+};
+
+/// Create a pool that keeps `count` profiles per browser ready, located according to `placement`.
+ProfilePool::ProfilePool (size_t count, const ProfilePlacement &placement) :
+  impl_ (std::make_shared<Impl> (count, placement))
+{
+  impl_->thread = std::thread (&Impl::refill_loop, impl_.get());
+}
+
+/// Stop refilling and remove all unclaimed profile directories.
+ProfilePool::~ProfilePool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (impl_->mutex);
+    impl_->quit = true;
+  }
+  impl_->cond.notify_all();
+  impl_->thread.join();
+  for (Impl::Slot &slot : impl_->slots)
+    for (const std::string &pdir : slot.ready) {
+      std::error_code ec;
+      std::filesystem::remove_all (pdir, ec);
+    }
+}
+
+/// Start preparing profiles for `browser` in the background.
+void
+ProfilePool::prepare (const BrowserInfo &browser, const std::string &appname)
+{
+  const std::string app = default_appname (appname);
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  if (!impl_->find (browser, app))
+    impl_->slots.push_back (Impl::Slot { browser, app, {} });
+  impl_->cond.notify_all();
+}
+
+/// Number of profiles ready to be claimed for `browser`.
+size_t
+ProfilePool::ready (const BrowserInfo &browser, const std::string &appname)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  Impl::Slot *slot = impl_->find (browser, default_appname (appname));
+  return slot ? slot->ready.size() : 0;
+}
+
+/// Take a fresh profile directory out of the pool, each directory is handed out only once.
+/// Staged tmpfs profiles are discarded if the tmpfs no longer has ProfilePlacement::tmpfs_reserve available.
+std::string
+ProfilePool::claim (const BrowserInfo &browser, const std::string &appname)
+{
+  const std::string app = default_appname (appname);
+  std::unique_lock<std::mutex> lock (impl_->mutex);
+  Impl::Slot *slot = impl_->find (browser, app);
+  if (!slot) {
+    impl_->slots.push_back (Impl::Slot { browser, app, {} });
+    slot = &impl_->slots.back();
+  }
+  std::string pdir;
+  while (pdir.empty() && !slot->ready.empty()) {
+    pdir = slot->ready.front();
+    slot->ready.pop_front();
+    if (!path_exists (pdir))
+      pdir = "";
+    else if (path_store (pdir) == ProfileStore::Tmpfs && !path_has_space (pdir, impl_->placement.tmpfs_reserve)) {
+      // the tmpfs filled up since the profile was staged, let create_profile() fall back to disk
+      WEBHEAD_DEBUG ("ProfilePool: discarding, tmpfs lacks space: %s\n", pdir.c_str());
+      std::error_code ec;
+      std::filesystem::remove_all (pdir, ec);
+      pdir = "";
+    }
+  }
+  impl_->cond.notify_all();
+  lock.unlock();
+  // pool exhausted, create profile synchronously
+  return pdir.empty() ? create_profile (browser, app, impl_->placement) : pdir;
+}
+
+// == HttpServer ==
+/// MIME type for the extension of `filename`.
+static const char*
+mime_type (const std::string &filename)
+{
+  static const std::pair<const char*, const char*> types[] = {
+    { ".html", "text/html; charset=utf-8" },    { ".htm", "text/html; charset=utf-8" },
+    { ".css", "text/css; charset=utf-8" },      { ".js", "text/javascript; charset=utf-8" },
+    { ".mjs", "text/javascript; charset=utf-8" }, { ".json", "application/json" },
+    { ".map", "application/json" },             { ".svg", "image/svg+xml" },
+    { ".png", "image/png" },                    { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" },                  { ".gif", "image/gif" },
+    { ".webp", "image/webp" },                  { ".ico", "image/x-icon" },
+    { ".woff", "font/woff" },                   { ".woff2", "font/woff2" },
+    { ".ttf", "font/ttf" },                     { ".wasm", "application/wasm" },
+    { ".txt", "text/plain; charset=utf-8" },    { ".xml", "application/xml" },
+  };
+  const std::string ext = std::filesystem::path (filename).extension();
+  for (const auto &t : types)
+    if (strcasecmp (ext.c_str(), t.first) == 0)
+      return t.second;
+  return "application/octet-stream";
+}
+
+/// Decode %XX escapes of an URL path, yields "" for invalid escapes.
+static std::string
+url_unescape (const std::string &s)
+{
+  std::string r;
+  for (size_t i = 0; i < s.size(); i++)
+    if (s[i] != '%')
+      r += s[i];
+    else if (i + 2 < s.size() && isxdigit (s[i + 1]) && isxdigit (s[i + 2])) {
+      r += char (std::stoi (s.substr (i + 1, 2), nullptr, 16));
+      i += 2;
+    } else
+      return "";
+  return r;
+}
+
+/// A file variant (identity, gzip, br) of a served path.
+struct HttpAsset {
+  std::string filename, encoding;
+  std::string etag;
+  size_t      size = 0;
+  std::shared_ptr<const std::string> body;      // in-memory copy, null if served with sendfile()
+};
+
+/// Cached lookup result for an URL path.
+struct HttpCacheEntry {
+  uint64_t               checked = 0;           // timestamp_monotonic() of the last stat()
+  std::string            mime;
+  std::vector<HttpAsset> variants;              // empty if the path does not exist
+};
+
+struct HttpConnection;
+
+/// Listening socket, I/O thread and hot-asset cache of an HttpServer.
+struct HttpServer::Impl {
+  HttpServerOptions              options;
+  boost::asio::io_context        ioc;
+  boost::asio::ip::tcp::acceptor acceptor { ioc };
+  std::thread                    thread;
+  std::mutex                     mutex;         // guards hooks and upgrades, the cache is only used by the I/O thread
+  std::vector<std::function<void()>> next_request_hooks;
+  // WebSocket upgrade handlers per path, these take over the socket by returning true
+  using UpgradeHandler = std::function<bool (boost::asio::ip::tcp::socket &socket, const std::string &target, const std::string &key)>;
+  std::unordered_map<std::string, UpgradeHandler> upgrades;
+  std::vector<const Bundle*>     bundles;       // guarded by mutex, searched before the docroot
+  // handlers for exact paths, these may answer later and from any thread
+  using Responder = std::function<void (const std::string &mime, const std::string &content)>;
+  std::unordered_map<std::string, std::function<void (const Responder&)>> routes; // guarded by mutex
+  std::unordered_map<std::string, HttpCacheEntry> cache;
+  size_t                         cache_bytes = 0;
+  explicit Impl (const HttpServerOptions &o) : options (o) {}
+  void                  accept  ();
+  const HttpCacheEntry& lookup  (const std::string &urlpath);
+  void                  refresh (HttpCacheEntry &entry, const std::string &urlpath);
+  const BundleFile*     bundled (const std::string &urlpath);
+  void
+  notify_request ()
+  {
+    std::vector<std::function<void()>> hooks;
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      hooks.swap (next_request_hooks);
+    }
+    for (auto &hook : hooks)
+      hook();
+  }
+};
+
+/// Stat the file variants for `urlpath` and (re-)load small files into memory.
+void
+HttpServer::Impl::refresh (HttpCacheEntry &entry, const std::string &urlpath)
+{
+  namespace fs = std::filesystem;
+  if (options.docroot.empty()) {
+    entry.variants.clear();
+    entry.checked = timestamp_monotonic();
+    return;
+  }
+  std::string filename = fs::path (options.docroot) / urlpath.substr (1);
+  struct stat st = {};
+  if (stat (filename.c_str(), &st) == 0 && S_ISDIR (st.st_mode))
+    filename = fs::path (filename) / "index.html";
+  entry.mime = mime_type (filename);
+  std::vector<HttpAsset> variants;
+  for (const char *encoding : { "", "gzip", "br" }) {
+    const std::string variant = filename + (encoding[0] == 0 ? "" : encoding[0] == 'g' ? ".gz" : ".br");
+    if (stat (variant.c_str(), &st) != 0 || !S_ISREG (st.st_mode))
+      continue;
+    HttpAsset asset { .filename = variant, .encoding = encoding, .size = size_t (st.st_size) };
+    asset.etag = posix_printf ("\"%llx-%llx-%llx.%lx%s%s\"", (long long unsigned) st.st_ino, (long long unsigned) st.st_size,
+                               (long long unsigned) st.st_mtim.tv_sec, st.st_mtim.tv_nsec, encoding[0] ? "-" : "", encoding);
+    for (const HttpAsset &old : entry.variants)
+      if (old.filename == variant && old.etag == asset.etag)
+        asset.body = old.body;
+    if (!asset.body && asset.size <= options.cache_file_limit && cache_bytes + asset.size <= options.cache_max_bytes) {
+      std::string contents = read_string (variant);
+      if (contents.size() == asset.size) {
+        asset.body = std::make_shared<const std::string> (std::move (contents));
+        cache_bytes += asset.size;
+      }
+    }
+    variants.push_back (asset);
+  }
+  for (const HttpAsset &old : entry.variants)
+    if (old.body && std::none_of (variants.begin(), variants.end(), [&old] (const HttpAsset &a) { return a.body == old.body; }))
+      cache_bytes -= old.size;
+  entry.variants = std::move (variants);
+  entry.checked = timestamp_monotonic();
+}
+
+/// Find the variants for `urlpath`, without touching the file system if checked recently.
+const HttpCacheEntry&
+HttpServer::Impl::lookup (const std::string &urlpath)
+{
+  if (cache.size() > 4096 && !cache.count (urlpath)) {
+    // bound the number of entries, e.g. against 404 scans
+    cache.clear();
+    cache_bytes = 0;
+  }
+  HttpCacheEntry &entry = cache[urlpath];
+  if (!entry.checked || timestamp_monotonic() - entry.checked >= uint64_t (options.revalidate_ms) * 1000)
+    refresh (entry, urlpath);
+  return entry;
+}
+
+/// Find `urlpath` in the mounted bundles, directories map to their index.html.
+const BundleFile*
+HttpServer::Impl::bundled (const std::string &urlpath)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  for (const Bundle *bundle : bundles) {
+    const BundleFile *file = urlpath.back() == '/' ? bundle->find (urlpath + "index.html") : bundle->find (urlpath);
+    if (file)
+      return file;
+  }
+  return nullptr;
+}
+
+/// A keep-alive HTTP/1.1 client connection.
+struct HttpConnection : std::enable_shared_from_this<HttpConnection> {
+  HttpServer::Impl             &server;
+  boost::asio::ip::tcp::socket  socket;
+  boost::asio::streambuf        inbuf { 65536 };
+  std::string                   header;
+  std::shared_ptr<const std::string> body;
+  boost::asio::const_buffer     rodata;         // body from a Bundle
+  int                           filefd = -1;
+  off_t                         offset = 0;
+  size_t                        remaining = 0;
+  bool                          keep_alive = true;
+  HttpConnection (HttpServer::Impl &s, boost::asio::ip::tcp::socket sock) : server (s), socket (std::move (sock)) {}
+  ~HttpConnection() { if (filefd >= 0) close (filefd); }
+  void read_request ();
+  void handle       (const std::string &request);
+  void respond      (int status, const char *reason, const std::string &extra_headers, bool has_length);
+  void send_file    ();
+  void finish       ();
+};
+
+void
+HttpConnection::read_request ()
+{
+  auto self = shared_from_this();
+  boost::asio::async_read_until (socket, inbuf, "\r\n\r\n", [self] (const boost::system::error_code &ec, size_t n) {
+    if (ec) return;     // closed, error or oversized request
+    std::string request (boost::asio::buffers_begin (self->inbuf.data()), boost::asio::buffers_begin (self->inbuf.data()) + n);
+    self->inbuf.consume (n);
+    self->handle (request);
+  });
+}
+
+/// Parse request line and headers, then answer from cache or with sendfile().
+void
+HttpConnection::handle (const std::string &request)
+{
+  const std::vector<std::string> lines = string_split (request, '\n');
+  const std::vector<std::string> reqline = string_split (lines[0].substr (0, lines[0].find ('\r')), ' ');
+  if (reqline.size() != 3 || reqline[2].compare (0, 5, "HTTP/") != 0) {
+    keep_alive = false;
+    return respond (400, "Bad Request", "", false);
+  }
+  std::string connection, accept_encoding, if_none_match, upgrade, websocket_key;
+  for (size_t i = 1; i < lines.size(); i++) {
+    const size_t colon = lines[i].find (':');
+    if (colon == std::string::npos) continue;
+    std::string value = lines[i].substr (colon + 1);
+    value.erase (0, value.find_first_not_of (" \t"));
+    value.erase (value.find_last_not_of (" \t\r") + 1);
+    const std::string name = lines[i].substr (0, colon);
+    if (strcasecmp (name.c_str(), "Connection") == 0)
+      connection = value;
+    else if (strcasecmp (name.c_str(), "Accept-Encoding") == 0)
+      accept_encoding = value;
+    else if (strcasecmp (name.c_str(), "If-None-Match") == 0)
+      if_none_match = value;
+    else if (strcasecmp (name.c_str(), "Upgrade") == 0)
+      upgrade = value;
+    else if (strcasecmp (name.c_str(), "Sec-WebSocket-Key") == 0)
+      websocket_key = value;
+  }
+  keep_alive = reqline[2] == "HTTP/1.0" ? strcasecmp (connection.c_str(), "keep-alive") == 0 : strcasecmp (connection.c_str(), "close") != 0;
+  server.notify_request();
+  const std::string &method = reqline[0];
+  if (method == "GET" && strcasecmp (upgrade.c_str(), "websocket") == 0) {
+    HttpServer::Impl::UpgradeHandler handler;
+    {
+      std::lock_guard<std::mutex> lock (server.mutex);
+      auto it = server.upgrades.find (reqline[1].substr (0, reqline[1].find ('?')));
+      if (it != server.upgrades.end())
+        handler = it->second;
+    }
+    // the handler takes over the socket on success
+    if (handler && handler (socket, reqline[1], websocket_key))
+      return;
+    keep_alive = false;
+    return respond (403, "Forbidden", "", false);
+  }
+  if (method != "GET" && method != "HEAD")
+    return respond (405, "Method Not Allowed", "Allow: GET, HEAD\r\n", false);
+  const std::string urlpath = url_unescape (reqline[1].substr (0, reqline[1].find_first_of ("?#")));
+  if (urlpath.empty() || urlpath[0] != '/' || urlpath.find ("/..") != std::string::npos || urlpath.find ('\0') != std::string::npos)
+    return respond (400, "Bad Request", "", false);
+  std::function<void (const HttpServer::Impl::Responder&)> route;
+  {
+    std::lock_guard<std::mutex> lock (server.mutex);
+    auto it = server.routes.find (urlpath);
+    if (it != server.routes.end())
+      route = it->second;
+  }
+  if (route && method == "GET") {
+    auto self = shared_from_this();
+    return route ([self] (const std::string &mime, const std::string &content) {
+      boost::asio::post (self->socket.get_executor(), [self, mime, content] () {
+        self->body = std::make_shared<const std::string> (content);
+        self->respond (200, "OK", posix_printf ("Content-Type: %s\r\nCache-Control: no-store\r\nContent-Length: %zu\r\n",
+                                                mime.c_str(), content.size()), true);
+      });
+    });
+  }
+  if (const BundleFile *file = server.bundled (urlpath)) {
+    // served from read-only memory, variants and ETags are precomputed
+    const BundleBlob *blob = &file->identity;
+    if (file->gzip.size && accept_encoding.find ("gzip") != std::string::npos)
+      blob = &file->gzip;
+    if (file->br.size && accept_encoding.find ("br") != std::string::npos)
+      blob = &file->br;
+    std::string headers = posix_printf ("Content-Type: %s\r\nETag: %s\r\nCache-Control: no-cache\r\n", file->mime, blob->etag);
+    if (file->gzip.size || file->br.size)
+      headers += "Vary: Accept-Encoding\r\n";
+    if (blob != &file->identity)
+      headers += blob == &file->br ? "Content-Encoding: br\r\n" : "Content-Encoding: gzip\r\n";
+    if (!if_none_match.empty() && (if_none_match == "*" || if_none_match.find (blob->etag) != std::string::npos))
+      return respond (304, "Not Modified", headers, true);
+    if (method == "GET")
+      rodata = boost::asio::buffer (blob->data, blob->size);
+    return respond (200, "OK", headers + posix_printf ("Content-Length: %zu\r\n", blob->size), true);
+  }
+  const HttpCacheEntry &entry = server.lookup (urlpath);
+  // pick the best precompressed variant the client accepts
+  const HttpAsset *asset = nullptr;
+  for (const HttpAsset &a : entry.variants)
+    if (a.encoding.empty() || accept_encoding.find (a.encoding) != std::string::npos)
+      asset = &a;
+  if (!asset)
+    return respond (404, "Not Found", "", false);
+  std::string headers = posix_printf ("Content-Type: %s\r\nETag: %s\r\nCache-Control: no-cache\r\n", entry.mime.c_str(), asset->etag.c_str());
+  if (entry.variants.size() > 1)
+    headers += "Vary: Accept-Encoding\r\n";
+  if (!asset->encoding.empty())
+    headers += "Content-Encoding: " + asset->encoding + "\r\n";
+  if (!if_none_match.empty() && (if_none_match == "*" || if_none_match.find (asset->etag) != std::string::npos))
+    return respond (304, "Not Modified", headers, true);
+  if (method == "GET" && asset->body)
+    body = asset->body;
+  else if (method == "GET") {
+    filefd = open (asset->filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (filefd < 0)
+      return respond (404, "Not Found", "", false);
+    offset = 0;
+    remaining = asset->size;
+  }
+  respond (200, "OK", headers + posix_printf ("Content-Length: %zu\r\n", asset->size), true);
+}
+
+/// Send status line and headers, followed by a cached body or a file.
+void
+HttpConnection::respond (int status, const char *reason, const std::string &extra_headers, bool has_length)
+{
+  header = posix_printf ("HTTP/1.1 %d %s\r\n", status, reason) + extra_headers;
+  if (!has_length)
+    header += status == 304 ? "" : "Content-Length: 0\r\n";
+  header += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  std::vector<boost::asio::const_buffer> buffers = { boost::asio::buffer (header) };
+  if (body)
+    buffers.push_back (boost::asio::buffer (*body));
+  if (rodata.size())
+    buffers.push_back (rodata);
+  auto self = shared_from_this();
+  boost::asio::async_write (socket, buffers, [self] (const boost::system::error_code &ec, size_t) {
+    self->body = nullptr;
+    self->rodata = {};
+    if (ec) return;
+    if (self->filefd >= 0)
+      self->send_file();
+    else
+      self->finish();
+  });
+}
+
+/// Copy the file to the socket in kernel space.
+void
+HttpConnection::send_file ()
+{
+  socket.non_blocking (true);
+  while (remaining > 0) {
+    const ssize_t n = write_nosigpipe ([&] () { return ::sendfile (socket.native_handle(), filefd, &offset, remaining); });
+    if (n > 0)
+      remaining -= n;
+    else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      auto self = shared_from_this();
+      socket.async_wait (boost::asio::ip::tcp::socket::wait_write, [self] (const boost::system::error_code &ec) {
+        if (!ec) self->send_file();
+      });
+      return;
+    } else
+      return;   // file truncated or connection lost, drop the connection
+  }
+  close (filefd);
+  filefd = -1;
+  finish();
+}
+
+void
+HttpConnection::finish ()
+{
+  if (keep_alive)
+    read_request();
+  else {
+    boost::system::error_code ec;
+    socket.shutdown (boost::asio::ip::tcp::socket::shutdown_both, ec);
+  }
+}
+
+void
+HttpServer::Impl::accept ()
+{
+  acceptor.async_accept ([this] (const boost::system::error_code &ec, boost::asio::ip::tcp::socket socket) {
+    if (ec == boost::asio::error::operation_aborted) return;
+    if (!ec) {
+      socket.set_option (boost::asio::ip::tcp::no_delay (true));
+      std::make_shared<HttpConnection> (*this, std::move (socket))->read_request();
+    }
+    accept();
+  });
+}
+
+/// Create a server for the files in `options.docroot`.
+HttpServer::HttpServer (const HttpServerOptions &options) :
+  impl_ (std::make_shared<Impl> (options))
+{}
+
+/// Stop serving and close all connections.
+HttpServer::~HttpServer ()
+{
+  stop();
+}
+
+/// Listen on an ephemeral loopback port and start serving on a separate thread, returns errno.
+int
+HttpServer::listen ()
+{
+  namespace ip = boost::asio::ip;
+  if (impl_->thread.joinable()) return EBUSY;
+  boost::system::error_code ec;
+  impl_->acceptor.open (ip::tcp::v4(), ec);
+  if (!ec) impl_->acceptor.bind (ip::tcp::endpoint (ip::address_v4::loopback(), impl_->options.port), ec);
+  if (!ec) impl_->acceptor.listen (boost::asio::socket_base::max_listen_connections, ec);
+  if (ec) {
+    impl_->acceptor.close (ec);
+    return ec.value() ? ec.value() : EIO;
+  }
+  impl_->accept();
+  impl_->thread = std::thread ([this] () { impl_->ioc.run(); });
+  return 0;
+}
+
+/// Stop the I/O thread, further requests are refused.
+void
+HttpServer::stop ()
+{
+  if (!impl_->thread.joinable()) return;
+  impl_->ioc.stop();
+  impl_->thread.join();
+  boost::system::error_code ec;
+  impl_->acceptor.close (ec);
+}
+
+/// Port number of the listening socket, or 0.
+int
+HttpServer::port () const
+{
+  boost::system::error_code ec;
+  return impl_->acceptor.is_open() ? impl_->acceptor.local_endpoint (ec).port() : 0;
+}
+
+/// URL for `path` on this server, suitable as Session url.
+std::string
+HttpServer::url (const std::string &path) const
+{
+  return posix_printf ("http://127.0.0.1:%d", port()) + (path.empty() || path[0] != '/' ? "/" : "") + path;
+}
+
+/// Call `hook` from the I/O thread once the next request arrives.
+void
+HttpServer::on_next_request (const std::function<void()> &hook)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->next_request_hooks.push_back (hook);
+}
+
+/// Serve the files of `bundle` before looking into the docroot, `bundle` must outlive the server.
+void
+HttpServer::mount (const Bundle &bundle)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->bundles.push_back (&bundle);
+}
+
+// == JsonIpc ==
+/// Encode `data` as base64.
+static std::string
+base64_encode (const uint8_t *data, size_t size)
+{
+  static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string r;
+  for (size_t i = 0; i < size; i += 3) {
+    const uint32_t v = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+    r += b64[v >> 18 & 63];
+    r += b64[v >> 12 & 63];
+    r += i + 1 < size ? b64[v >> 6 & 63] : '=';
+    r += i + 2 < size ? b64[v & 63] : '=';
+  }
+  return r;
+}
+
+/// Compute Sec-WebSocket-Accept for a Sec-WebSocket-Key, see RFC 6455.
+static std::string
+websocket_accept (const std::string &key)
+{
+  const std::string input = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  boost::uuids::detail::sha1 sha1;
+  sha1.process_bytes (input.data(), input.size());
+  unsigned int digest[5];
+  sha1.get_digest (digest);
+  uint8_t bytes[20];
+  for (size_t i = 0; i < 20; i++)
+    bytes[i] = digest[i / 4] >> (24 - 8 * (i % 4));
+  return base64_encode (bytes, sizeof (bytes));
+}
+
+/// Random hex string from /dev/urandom.
+static std::string
+random_token ()
+{
+  uint8_t bytes[16] = { 0, };
+  const int fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    if (read (fd, bytes, sizeof (bytes)) < 0) {}
+    close (fd);
+  }
+  std::string token;
+  for (uint8_t b : bytes)
+    token += posix_printf ("%02x", b);
+  return token;
+}
+
+/// Skip JSON whitespace.
+static const char*
+json_skip_space (const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+  return p;
+}
+
+/// Skip a JSON value without validating it, returns the position after the value or nullptr.
+static const char*
+json_skip_value (const char *p, const char *end)
+{
+  size_t depth = 0;
+  p = json_skip_space (p, end);
+  while (p < end) {
+    const char c = *p++;
+    if (c == '"') {
+      while (p < end && *p != '"')
+        p += *p == '\\' ? 2 : 1;
+      if (p++ >= end) return nullptr;
+    } else if (c == '{' || c == '[')
+      depth++;
+    else if (c == '}' || c == ']') {
+      if (depth-- == 0) return nullptr;
+    } else if (depth == 0) {
+      // number or literal
+      while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+        p++;
+    }
+    if (depth == 0)
+      return p;
+  }
+  return nullptr;
+}
+
+/// Call `element (raw_value)` for each element of a JSON array, returns false on syntax errors.
+template<class Element> static bool
+json_foreach_element (std::string_view json, const Element &element)
+{
+  const char *p = json.data(), *const end = json.data() + json.size();
+  p = json_skip_space (p, end);
+  if (p >= end || *p++ != '[') return false;
+  while (true) {
+    p = json_skip_space (p, end);
+    if (p < end && *p == ']') return true;
+    const char *value = p;
+    p = json_skip_value (value, end);
+    if (!p) return false;
+    element (std::string_view (value, p - value));
+    p = json_skip_space (p, end);
+    if (p < end && *p == ',')
+      p++;
+  }
+}
+
+/// Call `member (name, raw_value)` for each member of a JSON object, returns false on syntax errors.
+template<class Member> static bool
+json_foreach_member (std::string_view json, const Member &member)
+{
+  const char *p = json.data(), *const end = json.data() + json.size();
+  p = json_skip_space (p, end);
+  if (p >= end || *p++ != '{') return false;
+  while (true) {
+    p = json_skip_space (p, end);
+    if (p < end && *p == '}') return true;
+    if (p >= end || *p != '"') return false;
+    const char *key = ++p;
+    while (p < end && *p != '"')
+      p += *p == '\\' ? 2 : 1;
+    if (p >= end) return false;
+    const std::string_view name (key, p++ - key);
+    p = json_skip_space (p, end);
+    if (p >= end || *p++ != ':') return false;
+    const char *value = json_skip_space (p, end);
+    p = json_skip_value (value, end);
+    if (!p) return false;
+    member (name, std::string_view (value, p - value));
+    p = json_skip_space (p, end);
+    if (p < end && *p == ',')
+      p++;
+  }
+}
+
+/// Parse `{"id":…,"method":"…","params":…}` in place, without allocating.
+static bool
+json_parse_call (std::string_view json, JsonIpc::Call &call)
+{
+  call = JsonIpc::Call();
+  const bool valid = json_foreach_member (json, [&call] (std::string_view name, std::string_view raw) {
+    if (name == "id") {
+      char *endptr = nullptr;
+      call.id = strtoll (raw.data(), &endptr, 10);
+      if (endptr != raw.data() + raw.size()) call.id = -1;
+    } else if (name == "method" && raw.size() >= 2 && raw[0] == '"')
+      call.method = raw.substr (1, raw.size() - 2);
+    else if (name == "params")
+      call.params = raw;
+  });
+  return valid && !call.method.empty();
+}
+
+struct WsConnection;
+
+/// Outgoing queues, handlers and the current connection of a JsonIpc channel.
+struct JsonIpc::Impl : std::enable_shared_from_this<JsonIpc::Impl> {
+  JsonIpcOptions                options;
+  HttpServerP                   server;
+  boost::asio::io_context      &ioc;
+  std::string                   token;
+  std::shared_ptr<WsConnection> connection;     // only used from the I/O thread
+  std::unique_ptr<boost::asio::steady_timer> flush_timer;
+  mutable std::mutex            mutex;          // guards the members below
+  std::shared_ptr<const Handler> call_handler;  // snapshots are taken per message, copying a shared_ptr does not allocate
+  std::shared_ptr<const std::function<void (const void*, size_t)>> binary_handler;
+  std::function<void()>         drain_handler;
+  struct Pending {
+    std::string key, json;                      // a keyed message, or a run of comma separated unkeyed messages
+  };
+  std::vector<Pending>          pending;        // in send order, keyed messages keep the position of their first send
+  std::unordered_map<std::string, size_t> keyed; // index into `pending` per key
+  std::deque<std::string>       binaries;
+  size_t                        queued = 0, inflight = 0; // inflight bytes are part of queued until their write completes
+  bool                          flush_posted = false, congested = false, is_connected = false;
+  Impl (const HttpServerP &s, boost::asio::io_context &io, const JsonIpcOptions &o) :
+    options (o), server (s), ioc (io), token (random_token())
+  {}
+  bool enqueue        (std::string_view json, std::string_view key);
+  void schedule_flush ();
+  void flush          ();
+  void written        (size_t bytes);
+};
+
+/// A WebSocket connection speaking JSON-IPC, see RFC 6455 for the framing.
+struct WsConnection : std::enable_shared_from_this<WsConnection> {
+  std::shared_ptr<JsonIpc::Impl> ipc;
+  boost::asio::ip::tcp::socket   socket;
+  std::string                    rx, message, wtext, wbuf; // buffers are reused, so steady state traffic does not allocate
+  std::string                    control;       // pending control frames, written ahead of the next data
+  uint8_t                        message_opcode = 0;
+  size_t                         rxstart = 0;
+  bool                           writing = false, closed = false;
+  char                           chunk[65536];
+  WsConnection (const std::shared_ptr<JsonIpc::Impl> &i, boost::asio::ip::tcp::socket s) : ipc (i), socket (std::move (s)) {}
+  void read         ();
+  bool parse_frames ();
+  void dispatch     (uint8_t opcode);
+  void write_frame  (uint8_t opcode, std::string_view payload);
+  void close        ();
+};
+
+/// Append a WebSocket frame header for `size` bytes to `out`.
+static void
+websocket_frame_header (std::string &out, uint8_t opcode, size_t size)
+{
+  out += char (0x80 | opcode);
+  if (size < 126)
+    out += char (size);
+  else if (size < 65536) {
+    out += char (126);
+    out += char (size >> 8);
+    out += char (size);
+  } else {
+    out += char (127);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out += char (uint64_t (size) >> shift);
+  }
+}
+
+void
+WsConnection::read ()
+{
+  auto self = shared_from_this();
+  socket.async_read_some (boost::asio::buffer (chunk), [self] (const boost::system::error_code &ec, size_t n) {
+    if (ec || self->closed) return self->close();
+    self->rx.append (self->chunk, n);
+    if (self->parse_frames())
+      self->read();
+    else
+      self->close();
+  });
+}
+
+/// Decode complete frames from `rx`, returns false on protocol errors.
+bool
+WsConnection::parse_frames ()
+{
+  while (rx.size() - rxstart >= 2) {
+    const uint8_t *h = (const uint8_t*) rx.data() + rxstart;
+    const size_t avail = rx.size() - rxstart;
+    const bool fin = h[0] & 0x80, masked = h[1] & 0x80;
+    const uint8_t opcode = h[0] & 0x0f;
+    uint64_t length = h[1] & 0x7f;
+    size_t hlen = 2;
+    if (length == 126) {
+      if (avail < 4) break;
+      length = h[2] << 8 | h[3];
+      hlen = 4;
+    } else if (length == 127) {
+      if (avail < 10) break;
+      length = 0;
+      for (size_t i = 0; i < 8; i++)
+        length = length << 8 | h[2 + i];
+      hlen = 10;
+    }
+    if (!masked || length > ipc->options.max_message)
+      return false;     // client frames must be masked
+    if (avail < hlen + 4 + length) break;
+    const uint8_t *mask = h + hlen;
+    char *payload = &rx[rxstart + hlen + 4];
+    for (size_t i = 0; i < length; i++)
+      payload[i] ^= mask[i & 3];
+    rxstart += hlen + 4 + length;
+    if (opcode >= 0x8) {         // control frames
+      if (opcode == 0x8) {
+        write_frame (0x8, {});
+        return false;
+      }
+      if (opcode == 0x9)
+        write_frame (0xA, std::string_view (payload, length));
+      continue;
+    }
+    if (opcode != 0x0) {
+      message.clear();
+      message_opcode = opcode;
+    }
+    if (message.size() + length > ipc->options.max_message)
+      return false;
+    message.append (payload, length);
+    if (fin)
+      dispatch (message_opcode);
+  }
+  // compact the receive buffer without giving up its capacity
+  if (rxstart == rx.size())
+    rx.clear();
+  else if (rxstart > 65536)
+    rx.erase (0, rxstart);
+  else
+    return true;
+  rxstart = 0;
+  return true;
+}
+
+/// Hand a complete message to the call or binary handler.
+void
+WsConnection::dispatch (uint8_t opcode)
+{
+  std::unique_lock<std::mutex> lock (ipc->mutex);
+  if (opcode == 0x2) {
+    const auto handler = ipc->binary_handler;
+    lock.unlock();
+    if (handler && *handler)
+      (*handler) (message.data(), message.size());
+    return;
+  }
+  const auto handler = ipc->call_handler;
+  lock.unlock();
+  JsonIpc::Call call;
+  if (handler && *handler && json_parse_call (message, call))
+    (*handler) (call);
+}
+
+/// Queue a control frame, it is written by JsonIpc::Impl::flush() once no other write is in flight.
+void
+WsConnection::write_frame (uint8_t opcode, std::string_view payload)
+{
+  websocket_frame_header (control, opcode, payload.size());
+  control.append (payload);
+  if (!writing)
+    ipc->flush();
+}
+
+void
+WsConnection::close ()
+{
+  if (closed) return;
+  closed = true;
+  boost::system::error_code ec;
+  socket.shutdown (boost::asio::ip::tcp::socket::shutdown_both, ec);
+  socket.close (ec);
+  if (ipc->connection.get() == this) {
+    ipc->connection = nullptr;
+    std::lock_guard<std::mutex> lock (ipc->mutex);
+    ipc->is_connected = false;
+  }
+}
+
+/// Queue a message, replacing a pending one with the same `key`, returns false if the queue is congested.
+bool
+JsonIpc::Impl::enqueue (std::string_view json, std::string_view key)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (!key.empty()) {
+    const auto it = keyed.find (std::string (key));
+    if (it != keyed.end()) {
+      // the renderer only needs the latest state, which also keeps the queue bounded
+      std::string &value = pending[it->second].json;
+      queued += json.size();
+      queued -= value.size();
+      value.assign (json);
+      return true;
+    }
+  }
+  if (queued + json.size() > options.high_watermark) {
+    congested = true;
+    return false;
+  }
+  if (!key.empty()) {
+    keyed[std::string (key)] = pending.size();
+    pending.push_back (Pending { std::string (key), std::string (json) });
+  } else {
+    // consecutive unkeyed messages share one string
+    if (pending.empty() || !pending.back().key.empty())
+      pending.push_back (Pending());
+    std::string &run = pending.back().json;
+    if (!run.empty())
+      run += ',';
+    run.append (json);
+  }
+  queued += json.size();
+  return true;
+}
+
+/// Post a flush to the I/O thread unless one is pending.
+void
+JsonIpc::Impl::schedule_flush ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (flush_posted) return;
+    flush_posted = true;
+  }
+  auto self = shared_from_this();
+  boost::asio::post (ioc, [self] () {
+    if (self->options.flush_interval_ms <= 0)
+      return self->flush();
+    // coalesce everything sent within one frame interval
+    if (!self->flush_timer)
+      self->flush_timer = std::make_unique<boost::asio::steady_timer> (self->ioc);
+    self->flush_timer->expires_after (std::chrono::milliseconds (self->options.flush_interval_ms));
+    self->flush_timer->async_wait ([self] (const boost::system::error_code &ec) { if (!ec) self->flush(); });
+  });
+}
+
+/// Write pending control frames, all queued messages as one coalesced frame and pending binary frames, runs on the I/O thread.
+/// Text frames always carry a JSON array of messages in send order, so peers need not tell batches from array messages.
+void
+JsonIpc::Impl::flush ()
+{
+  std::shared_ptr<WsConnection> conn = connection;
+  std::unique_lock<std::mutex> lock (mutex);
+  flush_posted = false;
+  if (!conn || conn->writing || (pending.empty() && binaries.empty() && conn->control.empty()))
+    return;
+  // one socket write at a time, control frames go first
+  std::string &text = conn->wtext, &out = conn->wbuf;
+  out.swap (conn->control);
+  conn->control.clear();
+  if (!pending.empty()) {
+    text = '[';
+    for (const Pending &p : pending) {
+      if (&p != &pending.front()) text += ',';
+      text += p.json;
+    }
+    text += ']';
+    websocket_frame_header (out, 0x1, text.size());
+    out += text;
+  }
+  for (const std::string &binary : binaries) {
+    websocket_frame_header (out, 0x2, binary.size());
+    out += binary;
+  }
+  pending.clear();
+  keyed.clear();
+  binaries.clear();
+  // a replaced connection may still be writing, its bytes are accounted for separately
+  const size_t bytes = queued - inflight;
+  inflight += bytes;
+  lock.unlock();
+  conn->writing = true;
+  auto self = shared_from_this();
+  boost::asio::async_write (conn->socket, boost::asio::buffer (out), [self, conn, bytes] (const boost::system::error_code &ec, size_t) {
+    conn->writing = false;
+    if (ec)
+      conn->close();
+    // bytes of a failed write are lost with the connection, they must not keep the queue congested
+    self->written (bytes);
+  });
+}
+
+/// Account for written bytes, notify drain handlers and continue with queued messages.
+void
+JsonIpc::Impl::written (size_t bytes)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  queued -= std::min (queued, bytes);
+  inflight -= std::min (inflight, bytes);
+  std::function<void()> drained;
+  if (congested && queued <= options.low_watermark) {
+    congested = false;
+    drained = drain_handler;
+  }
+  const bool more = queued > 0 || (connection && !connection->control.empty());
+  lock.unlock();
+  if (drained)
+    drained();
+  if (more)
+    flush();
+}
+
+/// Create a JSON-IPC channel served by `server` under `options.path`.
+JsonIpc::JsonIpc (const HttpServerP &server, const JsonIpcOptions &options) :
+  impl_ (std::make_shared<Impl> (server, server->impl_->ioc, options))
+{
+  std::weak_ptr<Impl> wimpl = impl_;
+  std::lock_guard<std::mutex> lock (server->impl_->mutex);
+  server->impl_->upgrades[options.path] = [wimpl] (boost::asio::ip::tcp::socket &socket, const std::string &target, const std::string &key) {
+    std::shared_ptr<Impl> impl = wimpl.lock();
+    // only the web head that was handed the token may connect
+    if (!impl || target != impl->options.path + "?token=" + impl->token || key.empty())
+      return false;
+    const std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                 "Sec-WebSocket-Accept: " + websocket_accept (key) + "\r\n\r\n";
+    boost::system::error_code ec;
+    boost::asio::write (socket, boost::asio::buffer (response), ec);
+    if (ec) return true;
+    // a reloaded page replaces the previous connection
+    if (impl->connection)
+      impl->connection->close();
+    impl->connection = std::make_shared<WsConnection> (impl, std::move (socket));
+    impl->connection->rx.reserve (65536);
+    impl->connection->read();
+    {
+      std::lock_guard<std::mutex> lock (impl->mutex);
+      impl->is_connected = true;
+    }
+    impl->flush();
+    return true;
+  };
+}
+
+/// Close the connection and stop accepting new ones.
+JsonIpc::~JsonIpc ()
+{
+  {
+    std::lock_guard<std::mutex> lock (impl_->server->impl_->mutex);
+    impl_->server->impl_->upgrades.erase (impl_->options.path);
+  }
+  std::shared_ptr<Impl> impl = impl_;
+  boost::asio::post (impl->ioc, [impl] () {
+    if (impl->connection)
+      impl->connection->close();
+  });
+}
+
+/// Path and query for the WebSocket URL, relative to the HttpServer.
+std::string
+JsonIpc::endpoint () const
+{
+  return impl_->options.path + "?token=" + impl_->token;
+}
+
+/// Set the handler for incoming calls, it runs on the server I/O thread and must not keep the Call views.
+void
+JsonIpc::on_call (const Handler &handler)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->call_handler = std::make_shared<const Handler> (handler);
+}
+
+/// Set the handler for incoming binary messages, it runs on the server I/O thread.
+void
+JsonIpc::on_binary (const std::function<void (const void*, size_t)> &handler)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->binary_handler = std::make_shared<const std::function<void (const void*, size_t)>> (handler);
+}
+
+/// Set the handler called after send() failed once the queue shrinks below `low_watermark`.
+void
+JsonIpc::on_drain (const std::function<void()> &handler)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->drain_handler = handler;
+}
+
+/// Queue a JSON message, messages with the same non-empty `key` replace each other until written.
+/// Messages arrive as JSON arrays in send order, a replaced keyed message keeps the position of its first send.
+/// Returns false if the renderer fell behind by more than `high_watermark` bytes.
+bool
+JsonIpc::send (std::string_view json, std::string_view key)
+{
+  if (!impl_->enqueue (json, key))
+    return false;
+  impl_->schedule_flush();
+  return true;
+}
+
+/// Queue a binary frame for bulk payloads, subject to the same backpressure as send().
+bool
+JsonIpc::send_binary (const void *data, size_t size)
+{
+  {
+    std::lock_guard<std::mutex> lock (impl_->mutex);
+    if (impl_->queued + size > impl_->options.high_watermark) {
+      impl_->congested = true;
+      return false;
+    }
+    impl_->binaries.emplace_back ((const char*) data, size);
+    impl_->queued += size;
+  }
+  impl_->schedule_flush();
+  return true;
+}
+
+/// Send the result for a call with `id`.
+bool
+JsonIpc::reply (int64_t id, std::string_view result_json)
+{
+  char prefix[64];
+  const int n = snprintf (prefix, sizeof (prefix), "{\"id\":%lld,\"result\":", (long long) id);
+  std::string message;
+  message.reserve (n + result_json.size() + 1);
+  message.append (prefix, n).append (result_json) += '}';
+  return send (message);
+}
+
+/// Number of bytes queued or being written.
+size_t
+JsonIpc::queued () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->queued;
+}
+
+/// Check if the web head is connected.
+bool
+JsonIpc::connected () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->is_connected;
+}
+
+// == CdpPipe ==
+/// Quote `s` as JSON string.
+static std::string
+json_quote (const std::string &s)
+{
+  std::string r = "\"";
+  for (const char c : s)
+    if (c == '"' || c == '\\')
+      r += std::string ("\\") + c;
+    else if (uint8_t (c) < 0x20)
+      r += posix_printf ("\\u%04x", uint8_t (c));
+    else
+      r += c;
+  return r + "\"";
+}
+
+/// Value of a JSON string without the quotes, escapes are kept.
+static std::string_view
+json_unquote (std::string_view raw)
+{
+  return raw.size() >= 2 && raw[0] == '"' ? raw.substr (1, raw.size() - 2) : std::string_view();
+}
+
+/// Raw value of the member `name` of a JSON object.
+static std::string_view
+json_member (std::string_view json, std::string_view name)
+{
+  std::string_view found;
+  json_foreach_member (json, [&] (std::string_view key, std::string_view raw) {
+    if (key == name && found.empty())
+      found = raw;
+  });
+  return found;
+}
+
+/// A pending or queued CDP command.
+struct CdpCommand {
+  std::string       method, params;
+  CdpPipe::Callback callback;
+};
+
+/// Pipe file descriptors, pump thread and pending commands of a CdpPipe.
+struct CdpPipe::Impl {
+  int                 writefd = -1, readfd = -1;
+  int                 wakefds[2] = { -1, -1 };
+  std::thread         pump;
+  mutable std::mutex  mutex;        // guards the members below
+  std::mutex          write_mutex;
+  int64_t             next_id = 1;
+  std::unordered_map<int64_t, Callback> pending;
+  std::string         page_session; // flat session of the first page target
+  bool                attaching = false, closed = false;
+  std::vector<CdpCommand> queued;   // page commands waiting for page_session
+  EventHandler        event_handler;
+  ~Impl();
+  bool    send_raw       (const std::string &message);
+  int64_t send_command   (const std::string &method, const std::string &params, const Callback &callback, const std::string &session);
+  void    pump_loop      ();
+  void    handle_message (std::string_view message);
+  void    attach_page    (std::string_view target_info);
+  void    fail_all       ();
+};
+
+CdpPipe::Impl::~Impl()
+{
+  for (int fd : { writefd, readfd, wakefds[0], wakefds[1] })
+    if (fd >= 0) close (fd);
+}
+
+/// Write a NUL terminated message, see --remote-debugging-pipe.
+/// A failed write (e.g. EPIPE after the browser died) closes the pipe and fails all pending commands.
+bool
+CdpPipe::Impl::send_raw (const std::string &message)
+{
+  std::unique_lock<std::mutex> lock (write_mutex);
+  const char *data = message.c_str();
+  size_t size = message.size() + 1;
+  while (size) {
+    const ssize_t n = write_nosigpipe ([&] () { return write (writefd, data, size); });
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      lock.unlock();
+      fail_all();
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/// Send a command, the callback is called from the pump thread.
+int64_t
+CdpPipe::Impl::send_command (const std::string &method, const std::string &params, const Callback &callback, const std::string &session)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  if (closed) {
+    lock.unlock();
+    if (callback)
+      callback (false, "{\"message\":\"CDP pipe closed\"}");
+    return -1;
+  }
+  const int64_t id = next_id++;
+  if (callback)
+    pending[id] = callback;
+  lock.unlock();
+  std::string message = posix_printf ("{\"id\":%lld,\"method\":", (long long) id) + json_quote (method) + ",\"params\":" + (params.empty() ? "{}" : params);
+  if (!session.empty())
+    message += ",\"sessionId\":" + json_quote (session);
+  send_raw (message + "}");
+  return id;
 }
 
-/// Start the Firefox browser
-static Session::ProcessP
-start_firefox (const std::string &executable, bool snapdir, const std::string &url, const std::string appname)
+/// Attach to a page target with a flat session, so page commands can carry its sessionId.
+void
+CdpPipe::Impl::attach_page (std::string_view target_info)
 {
-  namespace fs = std::filesystem;
-  namespace bp = boost::process;
-  // Always start with a fresh profile
-  const std::string exename = fs::path (executable).filename();
-  const std::string pdir = create_webhead_tempdir (executable, appname, snapdir);
-  if (pdir == "") return nullptr;
-  const fs::path chrome = fs::path (pdir) / "chrome";
-  if (!path_mkdirs (chrome)) return nullptr;
-  create_profile_files (pdir, exename, snapdir, url, appname);
-  // Suppress some browser behaviours and allow userChrome.css
-  const std::string prefs_content =
-    "user_pref(\"app.normandy.first_run\", false);\n"
-    "user_pref(\"doh-rollout.doneFirstRun\", true);\n"
-    "user_pref(\"browser.cache.disk.enable\", false);\n"
-    "user_pref(\"browser.shell.checkDefaultBrowser\", false);\n"
-    "user_pref(\"browser.discovery.enabled\", false);\n"
-    "user_pref(\"datareporting.healthreport.uploadEnabled\", false);\n"
-    "user_pref(\"layout.css.has-selector.enabled\", true);\n"
-    "user_pref(\"toolkit.legacyUserProfileCustomizations.stylesheets\", true);\n"
-    "user_pref(\"toolkit.telemetry.reportingpolicy.firstRun\", false);\n";
-  write_string (fs::path (pdir) / "prefs.js", prefs_content);
-  // Remove the most useless firefox chrome elements to serve as web head
-  // Debug: DevTools > … > Settings [F1] > [x]EnableRemoteDebugging [x]EnableBrowserChromeToolbox // Browser: Ctrl+Shift+Alt+I
-  const std::string userchrome_content =
-    // Hide buttons useless for web heads
-    "toolbar#nav-bar toolbarbutton#unified-extensions-button, toolbar#nav-bar toolbarbutton#save-to-pocket-button { display: none; }\n"
-    // Hide main menu items
-    // "toolbaritem#menubar-items { display: none; }\n"
-    // Hide useless browser notifications about telemtry
-    "#navigator-toolbox vbox.notificationbox-stack.global-notificationbox { display: none; }\n"
-    // Hide single tab toolbar, tabs stay usable with Ctrl+T Ctrl+W
-    "toolbar#TabsToolbar:has(tab:only-of-type) { visibility: collapse; }\n"
-    // Hide Bookmarks Bar
-    "toolbar#PersonalToolbar { display: none; }\n";
-  write_string (chrome / "userChrome.css", userchrome_content);
-  // https://wiki.mozilla.org/Firefox/CommandLineOptions
-  std::vector<std::string> args = {
-    "--class=" + appname,
-    "--profile", pdir,          // enforce new seesion on each start
-    "--no-remote",
-    // "--kiosk",
-    "--private-window", url,
+  if (json_unquote (json_member (target_info, "type")) != "page")
+    return;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (attaching || !page_session.empty())
+      return;
+    attaching = true;
+  }
+  const std::string target_id (json_unquote (json_member (target_info, "targetId")));
+  send_command ("Target.attachToTarget", "{\"targetId\":\"" + target_id + "\",\"flatten\":true}", [this] (bool ok, const std::string &result) {
+    std::vector<CdpCommand> commands;
+    std::unique_lock<std::mutex> lock (mutex);
+    attaching = false;
+    if (!ok) return;
+    page_session = json_unquote (json_member (result, "sessionId"));
+    commands.swap (queued);
+    const std::string session = page_session;
+    lock.unlock();
+    for (const CdpCommand &c : commands)
+      send_command (c.method, c.params, c.callback, session);
+  }, "");
+}
+
+/// Dispatch a response to its callback or an event to the event handler.
+void
+CdpPipe::Impl::handle_message (std::string_view message)
+{
+  std::string_view id, method, params, result, error;
+  json_foreach_member (message, [&] (std::string_view key, std::string_view raw) {
+    if (key == "id") id = raw;
+    else if (key == "method") method = json_unquote (raw);
+    else if (key == "params") params = raw;
+    else if (key == "result") result = raw;
+    else if (key == "error") error = raw;
+  });
+  if (!id.empty()) {
+    Callback callback;
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      auto it = pending.find (strtoll (std::string (id).c_str(), nullptr, 10));
+      if (it == pending.end()) return;
+      callback = it->second;
+      pending.erase (it);
+    }
+    callback (error.empty(), std::string (error.empty() ? result : error));
+    return;
+  }
+  if (method == "Target.targetCreated" || method == "Target.targetInfoChanged")
+    attach_page (json_member (params, "targetInfo"));
+  else if (method == "Target.detachedFromTarget") {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (json_unquote (json_member (params, "sessionId")) == page_session)
+      page_session.clear();
+  }
+  EventHandler handler;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    handler = event_handler;
+  }
+  if (handler)
+    handler (std::string (method), std::string (params));
+}
+
+/// Read NUL separated messages until the browser closes the pipe.
+void
+CdpPipe::Impl::pump_loop ()
+{
+  std::string buffer;
+  char chunk[65536];
+  while (true) {
+    struct pollfd pfds[2] = { { wakefds[0], POLLIN, 0 }, { readfd, POLLIN, 0 } };
+    if (poll (pfds, 2, -1) < 0 && errno != EINTR)
+      break;
+    if (pfds[0].revents)
+      break;
+    if (!pfds[1].revents)
+      continue;
+    const ssize_t n = read (readfd, chunk, sizeof (chunk));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    buffer.append (chunk, n);
+    size_t start = 0;
+    for (size_t nul = buffer.find ('\0'); nul != std::string::npos; nul = buffer.find ('\0', start)) {
+      handle_message (std::string_view (buffer.data() + start, nul - start));
+      start = nul + 1;
+    }
+    buffer.erase (0, start);
+  }
+  fail_all();
+}
+
+/// Mark the pipe closed and fail everything still waiting for an answer.
+void
+CdpPipe::Impl::fail_all ()
+{
+  std::unordered_map<int64_t, Callback> failed;
+  std::vector<CdpCommand> commands;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    closed = true;
+    failed.swap (pending);
+    commands.swap (queued);
+  }
+  for (auto &it : failed)
+    it.second (false, "{\"message\":\"CDP pipe closed\"}");
+  for (auto &c : commands)
+    if (c.callback)
+      c.callback (false, "{\"message\":\"CDP pipe closed\"}");
+}
+
+/// Talk CDP over `writefd` and `readfd`, connected to the browser's fd 3 and fd 4.
+CdpPipe::CdpPipe (int writefd, int readfd) :
+  impl_ (std::make_shared<Impl>())
+{
+  impl_->writefd = writefd;
+  impl_->readfd = readfd;
+  if (pipe2 (impl_->wakefds, O_CLOEXEC) != 0)
+    impl_->wakefds[0] = impl_->wakefds[1] = -1;
+  impl_->pump = std::thread ([impl = impl_] () { impl->pump_loop(); });
+  // get notified about the app window, see attach_page()
+  impl_->send_command ("Target.setDiscoverTargets", "{\"discover\":true}", nullptr, "");
+}
+
+/// Stop the pump thread and close the pipe.
+CdpPipe::~CdpPipe ()
+{
+  if (impl_->wakefds[1] >= 0 && write (impl_->wakefds[1], "", 1) < 0) {}
+  if (impl_->pump.get_id() == std::this_thread::get_id())
+    impl_->pump.detach();       // released from a callback, the thread holds on to impl_
+  else
+    impl_->pump.join();
+}
+
+/// Send a CDP command, page commands are held back until the app page is attached.
+/// The callback receives the result or error object and runs on the pump thread.
+int64_t
+CdpPipe::call (const std::string &method, const std::string &params, const Callback &callback, bool page)
+{
+  if (page) {
+    std::unique_lock<std::mutex> lock (impl_->mutex);
+    if (impl_->page_session.empty() && !impl_->closed) {
+      impl_->queued.push_back (CdpCommand { method, params, callback });
+      return 0;
+    }
+    const std::string session = impl_->page_session;
+    lock.unlock();
+    return impl_->send_command (method, params, callback, session);
+  }
+  return impl_->send_command (method, params, callback, "");
+}
+
+/// Navigate the app page to `url`.
+void
+CdpPipe::navigate (const std::string &url, const Callback &callback)
+{
+  call ("Page.navigate", "{\"url\":" + json_quote (url) + "}", callback);
+}
+
+/// Reload the app page.
+void
+CdpPipe::reload (const Callback &callback)
+{
+  call ("Page.reload", "{\"ignoreCache\":false}", callback);
+}
+
+/// Evaluate JavaScript in the app page, awaiting promises and returning the value as JSON.
+void
+CdpPipe::evaluate (const std::string &expression, const Callback &callback)
+{
+  call ("Runtime.evaluate", "{\"expression\":" + json_quote (expression) + ",\"returnByValue\":true,\"awaitPromise\":true}", callback);
+}
+
+/// Fetch renderer performance metrics (JS heap, layout counts, timings) of the app page.
+void
+CdpPipe::metrics (const Callback &callback)
+{
+  call ("Performance.enable", "{}", nullptr);
+  call ("Performance.getMetrics", "{}", callback);
+}
+
+/// Set a handler for CDP events, it runs on the pump thread.
+void
+CdpPipe::on_event (const EventHandler &handler)
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  impl_->event_handler = handler;
+}
+
+/// Check if the app page is attached and page commands are sent immediately.
+bool
+CdpPipe::attached () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return !impl_->page_session.empty();
+}
+
+// == BrowserHost ==
+/// A window of the shared browser, `target_id` is known once the page target showed up.
+struct BrowserWindow {
+  std::string                     tag, target_id;
+  std::weak_ptr<Session::Process> session;
+};
+
+/// Browser process, profile and windows of a BrowserHost.
+struct BrowserHost::Impl : std::enable_shared_from_this<BrowserHost::Impl> {
+  static constexpr int launcher_timeout_ms = 5000; // for handing a window over to the running browser
+  const std::string          appname;
+  const ProfilePlacement     placement;
+  mutable std::mutex         mutex;     // guards the members below
+  BrowserInfo                browser;
+  std::string                pdir;
+  Session::ProcessP          process;   // the browser, launched for the first window
+  bool                       closing = false;
+  size_t                     next_window = 1;
+  std::vector<BrowserWindow> windows;
+  Impl (const std::string &a, const ProfilePlacement &p) : appname (a), placement (p) {}
+  int  open_window    (const Session::ProcessP &pp, const BrowserInfo &b, const std::string &url, const ResourceLimits &limits,
+                       const LogOptions &log);
+  int  close_window   (Session::Process &pp);
+  void release_window (const std::string &tag, const std::string &target_id);
+  void target_info    (std::string_view info);
+  void handle_event   (const std::string &method, const std::string &params);
+  void browser_exit   (const Session::Process *which, int exit_code);
+  void close_browser  ();
+};
+
+/// Check if `url` carries the `webhead-window=` fragment parameter for `tag`.
+static bool
+url_has_window_tag (const std::string &url, const std::string &tag)
+{
+  const std::string marker = "webhead-window=" + tag;
+  const size_t pos = url.find (marker);
+  return pos != std::string::npos && (pos + marker.size() == url.size() || url[pos + marker.size()] == '&');
+}
+
+/// Launch the browser for the first window, later windows are handed over by a short lived launcher process.
+int
+BrowserHost::Impl::open_window (const Session::ProcessP &pp, const BrowserInfo &b, const std::string &url, const ResourceLimits &limits,
+                                const LogOptions &log)
+{
+  if (b.type != BrowserType::Chromium && b.type != BrowserType::GoogleChrome)
+    return ENOTSUP;     // windows are tracked as CDP targets
+  Session::ProcessP retired, failed;    // released after the lock
+  std::unique_lock<std::mutex> lock (mutex);
+  const bool launch = closing || !process || !process->cdp || !process->child.running();
+  if (!launch && b.executable != browser.executable)
+    return EINVAL;      // one browser per host
+  const std::string tag = posix_printf ("%u-%zu", getpid(), next_window++);
+  const std::string tagged = url + (url.find ('#') == std::string::npos ? "#" : "&") + "webhead-window=" + tag;
+  pp->host = shared_from_this();
+  pp->window_tag = tag;
+  pp->window_open = true;
+  pp->pidfd = eventfd (0, EFD_CLOEXEC);
+  std::weak_ptr<Impl> wself = shared_from_this();
+  pp->release_window = [wself, tag] (const std::string &target_id) {
+    if (std::shared_ptr<Impl> self = wself.lock())
+      self->release_window (tag, target_id);
   };
-  // Start and redirect stdin/stdout/stderr which may be used by the application
+  windows.push_back (BrowserWindow { tag, "", pp });
+  auto forget = [this, &tag] () {
+    windows.erase (std::remove_if (windows.begin(), windows.end(), [&tag] (const BrowserWindow &w) { return w.tag == tag; }), windows.end());
+  };
+  std::vector<std::string> extra_args;
+  if (launch) {
+    // every browser launch starts out with a clean profile
+    uint64_t tempdir_stamp = 0;
+    const std::string newdir = create_profile (b, appname, placement, &tempdir_stamp);
+    if (newdir.empty()) {
+      const int err = errno ? errno : EIO;
+      forget();
+      return err;
+    }
+    pp->phase (SessionPhase::Tempdir, tempdir_stamp);
+    pp->phase (SessionPhase::Profile);
+    if (path_store (newdir) == ProfileStore::Tmpfs)
+      extra_args.push_back (posix_printf ("--disk-cache-size=%zu", placement.tmpfs_reserve / 2));
+    // the previous browser is reaped outside the lock, its monitor may be calling browser_exit()
+    retired.swap (process);
+    process = std::make_shared<Session::Process>();
+    browser = b;
+    pdir = newdir;
+    closing = false;
+    prepare_limits (*process, b.type, pdir, limits, extra_args);
+    process->log_options = log;
+    const Session::Process *which = process.get();
+    process->on_exit = [wself, which] (int exit_code) {
+      if (std::shared_ptr<Impl> self = wself.lock())
+        self->browser_exit (which, exit_code);
+    };
+    start_chromium_cdp (process, b.executable, pdir, tagged, appname, extra_args);
+    if (!process->child.running() || !process->cdp) {
+      const int err = errno ? errno : EINVAL;
+      forget();
+      failed.swap (process);
+      lock.unlock();
+      failed->shutdown (0);
+      return err;
+    }
+    pp->phase (SessionPhase::Spawn);
+    process->start_monitor (std::filesystem::path (pdir) / "WebHead.log");
+    process->cdp->on_event ([wself] (const std::string &method, const std::string &params) {
+      if (std::shared_ptr<Impl> self = wself.lock())
+        self->handle_event (method, params);
+    });
+    // pick up targets announced before the event handler was installed
+    process->cdp->call ("Target.getTargets", "{}", [wself] (bool ok, const std::string &result) {
+      std::shared_ptr<Impl> self = wself.lock();
+      if (self && ok)
+        json_foreach_element (json_member (result, "targetInfos"), [&self] (std::string_view info) { self->target_info (info); });
+    }, false);
+    return 0;
+  }
+  pp->phase (SessionPhase::Tempdir);
+  pp->phase (SessionPhase::Profile);
+  const std::string executable = browser.executable, profiledir = pdir;
+  lock.unlock();
+  // with the same --user-data-dir, Chromium passes the new app window to the running browser and exits
+  const std::vector<std::string> args = chromium_args (profiledir, tagged, extra_args);
   WEBHEAD_DEBUG ("%s: %s %s\n", __func__, executable.c_str(), string_join (" ", args).c_str());
-  Session::ProcessP pp = std::make_shared<Session::Process>();
-  const std::string logfile = fs::path (pdir) / "WebHead.log";
-  std::error_code ec{};
-  pp->child = bp::child (executable, bp::args (args), (bp::std_err & bp::std_out) > logfile, bp::std_in < bp::null, ec);
-  errno = ec.value();
-  return pp;
+  ChildSetup setup;
+  setup.process_group = false;
+  ChildProcess launcher;
+  int err = setup.redirect ("/dev/null", "/dev/null") ? launcher.spawn (executable, args, setup) : errno;
+  setup.release();
+  if (!err && !wait_child (launcher, launcher_timeout_ms)) {
+    launcher.terminate();
+    err = ETIMEDOUT;
+  } else if (!err && launcher.exit_code() != 0)
+    err = EIO;
+  if (err) {
+    lock.lock();
+    forget();
+    return err;
+  }
+  pp->phase (SessionPhase::Spawn);
+  return 0;
+}
+
+/// Close the page target of a window, its exit is recorded once the target is destroyed.
+int
+BrowserHost::Impl::close_window (Session::Process &pp)
+{
+  std::string target_id;
+  {
+    std::lock_guard<std::mutex> lock (pp.mutex);
+    if (!pp.window_open) return ESRCH;
+    target_id = pp.target_id;
+  }
+  if (target_id.empty())
+    return EAGAIN;      // the window has not shown up yet
+  std::unique_lock<std::mutex> lock (mutex);
+  CdpPipeP cdp = process ? process->cdp : nullptr;
+  lock.unlock();
+  if (!cdp) return ESRCH;
+  cdp->call ("Target.closeTarget", "{\"targetId\":" + json_quote (target_id) + "}", nullptr, false);
+  return 0;
+}
+
+/// Forget a window whose Session is gone, closing its target if still open.
+void
+BrowserHost::Impl::release_window (const std::string &tag, const std::string &target_id)
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  const auto it = std::find_if (windows.begin(), windows.end(), [&tag] (const BrowserWindow &w) { return w.tag == tag; });
+  if (it == windows.end()) return;
+  windows.erase (it);
+  CdpPipeP cdp = process ? process->cdp : nullptr;
+  const bool last = windows.empty();
+  lock.unlock();
+  if (cdp && !target_id.empty())
+    cdp->call ("Target.closeTarget", "{\"targetId\":" + json_quote (target_id) + "}", nullptr, false);
+  if (last)
+    close_browser();
+}
+
+/// Match a new or changed page target against the window tags.
+void
+BrowserHost::Impl::target_info (std::string_view info)
+{
+  if (json_unquote (json_member (info, "type")) != "page")
+    return;
+  const std::string target_id (json_unquote (json_member (info, "targetId")));
+  const std::string url (json_unquote (json_member (info, "url")));
+  Session::ProcessP pp;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (std::any_of (windows.begin(), windows.end(), [&target_id] (const BrowserWindow &w) { return w.target_id == target_id; }))
+      return;
+    for (BrowserWindow &w : windows)
+      if (w.target_id.empty() && url_has_window_tag (url, w.tag)) {
+        w.target_id = target_id;
+        pp = w.session.lock();
+        break;
+      }
+  }
+  if (pp) {
+    std::lock_guard<std::mutex> lock (pp->mutex);
+    pp->target_id = target_id;
+  }
+}
+
+/// Track windows through CDP target events, runs on the pump thread.
+void
+BrowserHost::Impl::handle_event (const std::string &method, const std::string &params)
+{
+  if (method == "Target.targetCreated" || method == "Target.targetInfoChanged")
+    return target_info (json_member (params, "targetInfo"));
+  if (method != "Target.targetDestroyed")
+    return;
+  const std::string target_id (json_unquote (json_member (params, "targetId")));
+  std::unique_lock<std::mutex> lock (mutex);
+  const auto it = std::find_if (windows.begin(), windows.end(), [&target_id] (const BrowserWindow &w) { return w.target_id == target_id; });
+  if (it == windows.end()) return;
+  Session::ProcessP pp = it->session.lock();
+  windows.erase (it);
+  const bool last = windows.empty();
+  lock.unlock();
+  if (pp)
+    pp->window_closed (0);
+  if (last)
+    close_browser();
+}
+
+/// All windows are gone with the browser, runs on the monitor thread.
+void
+BrowserHost::Impl::browser_exit (const Session::Process *which, int exit_code)
+{
+  std::vector<BrowserWindow> gone;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (which != process.get())
+      return;           // a retired browser
+    gone.swap (windows);
+  }
+  for (const BrowserWindow &w : gone)
+    if (Session::ProcessP pp = w.session.lock())
+      pp->window_closed (exit_code);
+}
+
+/// Ask the browser to quit once the last window is closed.
+void
+BrowserHost::Impl::close_browser ()
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  if (!windows.empty() || closing || !process || !process->cdp)
+    return;
+  closing = true;
+  CdpPipeP cdp = process->cdp;
+  lock.unlock();
+  cdp->call ("Browser.close", "{}", nullptr, false);
+}
+
+/// Create a host for windows of `appname`, the browser is launched by the first Session that uses it.
+BrowserHost::BrowserHost (const std::string &appname, const ProfilePlacement &placement) :
+  impl_ (std::make_shared<Impl> (default_appname (appname), placement))
+{}
+
+/// The browser keeps running until its windows are closed.
+BrowserHost::~BrowserHost ()
+{}
+
+/// Check if the shared browser is running.
+bool
+BrowserHost::running () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->process && !impl_->closing && impl_->process->child.running();
+}
+
+/// Number of open windows, including windows that are still being opened.
+size_t
+BrowserHost::windows () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->windows.size();
+}
+
+/// Profile directory shared by all windows of the current browser.
+std::string
+BrowserHost::profile_dir () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->pdir;
+}
+
+/// Browser level CDP connection, page commands are sent to the first window.
+CdpPipeP
+BrowserHost::cdp () const
+{
+  std::lock_guard<std::mutex> lock (impl_->mutex);
+  return impl_->process ? impl_->process->cdp : nullptr;
+}
+
+// == Session ==
+/// Record the first request to the embedded server for `wp`.
+static void
+watch_first_request (const HttpServerP &server, const std::weak_ptr<Session::Process> &wp)
+{
+  server->on_next_request ([wp] () {
+    if (Session::ProcessP pp = wp.lock())
+      pp->phase (SessionPhase::FirstRequest);
+  });
+}
+
+/// Resolve relative URLs against the embedded server and add the JsonIpc endpoint.
+static std::string
+session_url (std::string url, const SessionOptions &options)
+{
+  // relative URLs refer to the embedded server
+  if (options.http_server && url.find ("://") == std::string::npos)
+    url = options.http_server->url (url);
+  // hand the IPC endpoint to the page, the fragment is not sent in HTTP requests
+  if (options.jsonipc)
+    url += (url.find ('#') == std::string::npos ? "#jsonipc=" : "&jsonipc=") + options.jsonipc->endpoint();
+  return url;
 }
 
 /// Prepare web head session
-Session::Session (const std::string &url, const std::string &appname) :
-  url_ (url), app_ (appname)
+Session::Session (const std::string &url, const std::string &appname, const SessionOptions &options) :
+  url_ (session_url (url, options)), app_ (default_appname (appname)), options_ (options)
+{}
+
+/// Mount `bundle` on the HttpServer of `options`, or on a new one serving only the bundle.
+static SessionOptions
+bundle_options (const Bundle &bundle, SessionOptions options)
 {
-  if (app_.empty()) {
-    char buf[4096] = { 0, };
-    ssize_t n = ::readlink ("/proc/self/exe", buf, sizeof (buf) - 1);
-    app_ = n > 0 ? buf : "/proc/self/";
+  if (!options.http_server) {
+    HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions());
+    if (const int err = server->listen()) {
+      WEBHEAD_DEBUG ("%s: %s: failed to listen: %s\n", __func__, bundle.name, strerror (err));
+      return options;
+    }
+    options.http_server = server;
   }
+  options.http_server->mount (bundle);
+  return options;
+}
+
+/// Prepare web head session for `path` in `bundle`, served from memory by the HttpServer of `options` or a new one.
+Session::Session (const Bundle &bundle, const std::string &path, const std::string &appname, const SessionOptions &options) :
+  Session (path, appname, bundle_options (bundle, options))
+{
+  bundle_ = &bundle;
 }
 
 /// Start web head with the given `url` in `browser`, returns errno.
+/// Once spawned, the web head counts as started even if it exits right away, its exit is reported via on_exit.
 int
 Session::start (const BrowserInfo &browser)
 {
   if (process_) { WEBHEAD_DEBUG ("%s: session already started", __func__); return EINVAL; }
+  if (bundle_ && !options_.http_server)
+    return ENOTCONN;  // the bundle server failed to listen
+  if (browser.type == BrowserType::Any)
+    return ENOSYS;
+  ProcessP pp = std::make_shared<Process>();
+  pp->on_phase = options_.on_phase;
+  pp->on_exit = options_.on_exit;
+  pp->log_options = options_.log;
+  pp->phase (SessionPhase::Start);
+  uint64_t discovery_begin, discovery_end;
+  {
+    std::lock_guard<std::mutex> lock (last_discovery.mutex);
+    discovery_begin = last_discovery.begin;
+    discovery_end = last_discovery.end;
+  }
+  {
+    std::lock_guard<std::mutex> lock (pp->mutex);
+    pp->stats.discovery_begin = discovery_begin;
+  }
+  if (discovery_end)
+    pp->phase (SessionPhase::Discovery, discovery_end);
+  if (options_.browser_host) {
+    // windows share profile and process of the host browser
+    const int err = options_.browser_host->impl_->open_window (pp, browser, url_, options_.limits, options_.log);
+    if (err) {
+      stats_ = pp->stats;
+      return err;
+    }
+    process_ = pp;
+    profile_dir_ = options_.browser_host->profile_dir();
+    store_ = path_store (profile_dir_);
+    if (options_.http_server && !standby_)
+      watch_first_request (options_.http_server, process_);
+    return 0;
+  }
+  uint64_t tempdir_stamp = 0;
+  const std::string pdir = options_.profile_pool ? options_.profile_pool->claim (browser, app_) :
+                           create_profile (browser, app_, options_.placement, &tempdir_stamp);
+  if (pdir.empty()) {
+    stats_ = pp->stats;
+    return errno ? errno : EIO;
+  }
+  // pooled profiles were prepared in advance, so tempdir and profile both mark the claim
+  pp->phase (SessionPhase::Tempdir, tempdir_stamp);
+  pp->phase (SessionPhase::Profile);
+  profile_dir_ = pdir;
+  store_ = path_store (pdir);
+  if (options_.trace)
+    pp->open_trace (std::filesystem::path (pdir) / "WebHead.trace");
+  std::vector<std::string> extra_args;
+  prepare_limits (*pp, browser.type, pdir, options_.limits, extra_args);
+  if (options_.code_cache) {
+    pp->code_cache = CodeCache (browser, app_, pdir);
+    pp->code_cache.seed();
+  }
+  // standby launches only become ready once shown
+  if (options_.record_costs && !standby_) {
+    pp->cost_browser = browser;
+    pp->cost_by_request = options_.http_server != nullptr;
+  }
   switch (browser.type)
     {
     case BrowserType::Chromium:
     case BrowserType::GoogleChrome:
-      process_ = start_chromium (browser.executable, browser.snapdir, url_, app_);
+      // keep the HTTP cache from eating up the RAM backed profile
+      if (store_ == ProfileStore::Tmpfs)
+        extra_args.push_back (posix_printf ("--disk-cache-size=%zu", options_.placement.tmpfs_reserve / 2));
+      if (options_.cdp_pipe)
+        process_ = start_chromium_cdp (pp, browser.executable, pdir, url_, app_, extra_args);
+      else
+        process_ = start_chromium (pp, browser.executable, pdir, url_, app_, extra_args);
       break;
     case BrowserType::Epiphany:
-      process_ = start_epiphany (browser.executable, browser.snapdir, url_, app_);
+      process_ = start_epiphany (pp, browser.executable, pdir, url_, app_, extra_args);
       break;
     case BrowserType::Firefox:
-      process_ = start_firefox (browser.executable, browser.snapdir, url_, app_);
+      process_ = start_firefox (pp, browser.executable, pdir, url_, app_, extra_args);
       break;
     case BrowserType::Any:
-      errno = ENOSYS;
       break;
     }
-  if (process_ && process_->child.running())
+  // a spawned web head counts as started even if it already exited, the monitor reports its exit via on_exit
+  if (process_ && process_->child.valid()) {
     errno = 0;
+    process_->phase (SessionPhase::Spawn);
+    if (options_.http_server && !standby_)
+      watch_first_request (options_.http_server, process_);
+    process_->start_monitor (std::filesystem::path (pdir) / "WebHead.log");
+    // purge stale profiles only after the web head is spawned
+    if (options_.background_gc)
+      gc_async (options_.gc_options);
+  }
   else if (process_) {
     const int last = errno ? errno : EINVAL;
-    std::error_code ec{};
-    process_->child.terminate (ec);
-    process_->child.wait();
+    process_->shutdown (0);
+    stats_ = process_->stats;
     process_ = nullptr;
     errno = last;
   }
   return errno;
 }
 
-/// Check if the web head is still running.
+/// Shared between the routes of a standby bootstrap page and Session::show().
+struct StandbyPage {
+  std::mutex                        mutex;
+  std::string                       url;        // set once shown
+  HttpServer::Impl::Responder       reply;      // pending long-poll of the page
+  void
+  navigate (const std::string &target)
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    url = target;
+    HttpServer::Impl::Responder responder = std::move (reply);
+    reply = nullptr;
+    lock.unlock();
+    if (responder)
+      responder ("text/plain; charset=utf-8", target);
+  }
+};
+
+/// Launch the web head ahead of time on a blank page and keep it on standby until show() is called.
+/// Chromium waits on about:blank and is navigated via CDP, Firefox and Epiphany wait on a loopback
+/// bootstrap page that long-polls the embedded HttpServer for its destination.
+/// An unshown web head is killed after `SessionOptions::standby_timeout_ms`.
+int
+Session::start_standby (const BrowserInfo &browser)
+{
+  if (process_) { WEBHEAD_DEBUG ("%s: session already started", __func__); return EINVAL; }
+  if (options_.browser_host)
+    return ENOTSUP;     // windows of a running BrowserHost start warm already
+  std::function<void (const std::string&)> navigate;
+  std::function<void()> release;
+  std::string blank = "about:blank";
+  if (browser.type == BrowserType::Chromium || browser.type == BrowserType::GoogleChrome)
+    options_.cdp_pipe = true;
+  else if (browser.type == BrowserType::Firefox || browser.type == BrowserType::Epiphany) {
+    if (!options_.http_server) {
+      HttpServerP server = std::make_shared<HttpServer> (HttpServerOptions());
+      if (const int err = server->listen())
+        return err;
+      options_.http_server = server;
+    }
+    const std::string path = "/.webhead/standby-" + random_token();
+    const std::string html =
+      "<!DOCTYPE html>\n<meta charset=\"utf-8\"><title></title>\n<script>\n"
+      "(function poll() {\n"
+      "  fetch ('" + path + "/url', { cache: 'no-store' })\n"
+      "  .then (r => r.ok ? r.text() : Promise.reject (r.status))\n"
+      "  .then (url => location.replace (url), () => setTimeout (poll, 250));\n"
+      "}) ();\n</script>\n";
+    auto page = std::make_shared<StandbyPage>();
+    HttpServer::Impl &server = *options_.http_server->impl_;
+    {
+      std::lock_guard<std::mutex> lock (server.mutex);
+      server.routes[path] = [html] (const HttpServer::Impl::Responder &responder) {
+        responder ("text/html; charset=utf-8", html);
+      };
+      server.routes[path + "/url"] = [page] (const HttpServer::Impl::Responder &responder) {
+        std::unique_lock<std::mutex> lock (page->mutex);
+        if (page->url.empty()) {
+          page->reply = responder;      // a reloaded page supersedes the old poll
+          return;
+        }
+        const std::string url = page->url;
+        lock.unlock();
+        responder ("text/plain; charset=utf-8", url);
+      };
+    }
+    navigate = [page] (const std::string &url) { page->navigate (url); };
+    std::weak_ptr<HttpServer::Impl> wserver = options_.http_server->impl_;
+    release = [wserver, path] () {
+      if (auto server = wserver.lock()) {
+        std::lock_guard<std::mutex> lock (server->mutex);
+        server->routes.erase (path);
+        server->routes.erase (path + "/url");
+      }
+    };
+    blank = options_.http_server->url (path);
+  }
+  else
+    return ENOSYS;
+  const std::string url = url_;
+  url_ = blank;
+  standby_ = true;
+  const int err = start (browser);
+  url_ = url;
+  if (err || !process_) {
+    standby_ = false;
+    if (release)
+      release();
+    return err ? err : EIO;
+  }
+  ProcessP pp = process_;
+  if (!navigate) {
+    CdpPipeP cdp = pp->cdp;
+    // page commands are queued until the page target is attached
+    navigate = [cdp] (const std::string &url) {
+      if (cdp)
+        cdp->navigate (url, nullptr);
+    };
+  }
+  pp->standby_navigate = navigate;
+  pp->release_standby = release;
+  pp->standby = true;
+  if (options_.standby_timeout_ms > 0) {
+    const int timeout_ms = options_.standby_timeout_ms;
+    pp->standby_timer = std::thread ([pp = pp.get(), timeout_ms] () { pp->standby_wait (timeout_ms); });
+  }
+  return 0;
+}
+
+/// Navigate a web head from start_standby() to `url`, or to the session URL if empty.
+int
+Session::show (const std::string &url)
+{
+  ProcessP pp = process_;
+  if (!pp || !standby_)
+    return EINVAL;
+  if (!url.empty())
+    url_ = session_url (url, options_);
+  standby_ = false;
+  if (!pp->leave_standby() || !pp->child.running())
+    return ESRCH;       // reclaimed after SessionOptions::standby_timeout_ms
+  if (options_.http_server)
+    watch_first_request (options_.http_server, pp);
+  pp->standby_navigate (url_);
+  return 0;
+}
+
+/// Start the web head on a separate thread, the session must not be used until the future is ready.
+std::future<int>
+Session::start_async (const BrowserInfo &browser)
+{
+  return std::async (std::launch::async, [this, browser] () { return start (browser); });
+}
+
+/// Start the web head on a separate thread and call `done` with the errno result from that thread.
+void
+Session::start_async (const BrowserInfo &browser, const std::function<void (int)> &done)
+{
+  std::thread ([this, browser, done] () {
+    const int err = start (browser);
+    if (done)
+      done (err);
+  }).detach();
+}
+
+/// File descriptor that becomes readable once the web head exited, or -1.
+/// The descriptor is a pidfd owned by the session, it can be added to epoll(7) or poll(2) loops.
+/// Calling running() once it became readable is safe, the exit is still recorded and passed to `on_exit`.
+int
+Session::exit_fd () const
+{
+  return process_ ? process_->pidfd : -1;
+}
+
+/// Timestamps of the launch phases, the last failed start is reported if no web head is running.
+SessionStats
+Session::stats () const
+{
+  if (!process_)
+    return stats_;
+  std::lock_guard<std::mutex> lock (process_->mutex);
+  return process_->stats;
+}
+
+/// CDP connection of a session started with `SessionOptions::cdp_pipe`, or nullptr, see BrowserHost::cdp() for shared windows.
+CdpPipeP
+Session::cdp () const
+{
+  return process_ ? process_->cdp : nullptr;
+}
+
+/// Browser process running the web head, the shared browser for BrowserHost windows.
+static Session::ProcessP
+session_browser (const Session::ProcessP &pp)
+{
+  if (!pp || !pp->host)
+    return pp;
+  std::lock_guard<std::mutex> lock (pp->host->mutex);
+  return pp->host->process;
+}
+
+/// Lines of browser output captured in memory, see LogOptions::capture.
+/// Windows of a BrowserHost report the shared browser.
+std::vector<LogLine>
+Session::log_lines (LogSeverity min_severity) const
+{
+  const ProcessP bp = session_browser (process_);
+  return bp && bp->log ? bp->log->lines (min_severity) : std::vector<LogLine>();
+}
+
+/// Measure memory, CPU time, threads and processes of the browser process tree.
+/// Windows of a BrowserHost report the shared browser.
+ResourceSample
+Session::sample (const SampleOptions &options) const
+{
+  const ProcessP bp = session_browser (process_);
+  return bp && bp->child.running() ? sample_process_tree (bp->child.id(), bp->cgroup, options) : ResourceSample();
+}
+
+/// Sample the process tree periodically on a separate thread, until the web head exits or stop_sampling() is called.
+void
+Session::start_sampling (const SampleOptions &options, const std::function<void (const ResourceSample&)> &callback)
+{
+  stop_sampling();
+  const ProcessP bp = session_browser (process_);
+  if (!bp || !bp->child.running() || !callback)
+    return;
+  std::shared_ptr<bool> quit = std::make_shared<bool> (false);
+  {
+    std::lock_guard<std::mutex> lock (process_->mutex);
+    process_->sampler_quit = quit;
+  }
+  process_->sampler = std::thread (&Process::sample_loop, process_.get(), bp->child.id(), bp->cgroup, options, callback, quit);
+}
+
+/// Stop sampling started with start_sampling().
+void
+Session::stop_sampling ()
+{
+  if (process_)
+    process_->stop_sampler();
+}
+
+/// Record the first HTTP request for the app URL, to be called by the serving application.
+void
+Session::mark_first_request ()
+{
+  if (process_)
+    process_->phase (SessionPhase::FirstRequest);
+}
+
+/// Profile directory of a started session.
+std::string
+Session::profile_dir () const
+{
+  return profile_dir_;
+}
+
+/// Directory of the cgroup v2 that holds the web head processes, or "" if SessionOptions::limits use the fallback.
+std::string
+Session::cgroup () const
+{
+  const ProcessP bp = session_browser (process_);
+  return bp ? bp->cgroup : "";
+}
+
+/// Backing store of the profile directory, e.g. to check if the tmpfs placement succeeded.
+ProfileStore
+Session::profile_store () const
+{
+  return store_;
+}
+
+/// Check if the web head is still running, the exit is left to the monitor thread, which records it and calls `on_exit`.
 bool
 Session::running ()
 {
+  if (process_ && process_->host) {
+    std::lock_guard<std::mutex> lock (process_->mutex);
+    return process_->window_open;
+  }
   return process_ && process_->child.running();
 }
 
 /// Kill the web head with a signal if it is still running, returns errno.
+/// Windows of a shared browser are closed instead, regardless of `signal`.
 int
 Session::kill (int signal)
 {
   if (!running()) return ESRCH;
-  const int err = ::kill (process_->child.id(), signal);
-  const int last_errno = err < 0 && !errno ? EINVAL : errno;
-  WEBHEAD_DEBUG ("%s: killed, signal=%d, pid=%d: %s\n", __func__, signal, process_->child.id(), strerror (errno));
+  if (process_->host)
+    return process_->host->close_window (*process_);
+  // signal the process group, so helpers do not survive the browser
+  const pid_t pid = process_->child.id();
+  int err = ::kill (-pid, signal);
+  if (err != 0 && errno == ESRCH)
+    err = ::kill (pid, signal);
+  const int last_errno = err == 0 ? 0 : errno ? errno : EINVAL;
+  WEBHEAD_DEBUG ("%s: killed, signal=%d, pid=%d: %s\n", __func__, signal, pid, strerror (last_errno));
   return last_errno;
 }
 
+/// Terminate the web head with SIGTERM, escalate to SIGKILL after `timeout_ms` and reap all of its processes, returns errno.
+/// Returns ETIMEDOUT if SIGKILL was needed, windows of a shared browser are closed instead.
+int
+Session::shutdown (int timeout_ms)
+{
+  if (!process_) return ESRCH;
+  if (process_->host)
+    return running() ? process_->host->close_window (*process_) : ESRCH;
+  return process_->shutdown (timeout_ms);
+}
+
 } // WebHead
@@ -1,8 +1,12 @@
 // This Source Code Form is licensed MPL-2.0: http://mozilla.org/MPL/2.0
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace WebHead {
@@ -23,19 +27,336 @@ struct BrowserInfo {
   bool snapdir = false;
 };
 
+struct BrowserCost {
+  size_t   launches = 0;        // recorded launches, 0 if nothing is known about the browser
+  double   launch_ms = 0;       // median time from start to the first request (or output) of the web head
+  size_t   rss = 0;             // median steady-state RSS of the process tree in bytes, 0 if unknown
+};
+
+struct RankOptions {
+  double   launch_weight = 1.0;         // cost per second of launch time
+  double   memory_weight = 1.0;         // cost per GiB of RSS
+  double   integration_weight = 0.5;    // cost of browsers that lack an app mode (Firefox)
+  std::function<double (const BrowserInfo&, const BrowserCost&)> cost; // replaces the weighted sum if set
+};
+
+struct FindOptions {
+  bool parallel = false;        // launch all `--version` probes at once
+  int  probe_timeout_ms = 5000; // kill probes that hang
+  bool use_cache = true;        // reuse results for unchanged executables from $XDG_CACHE_HOME/WebHead
+  bool rescan = false;          // ignore cached results and probe every browser again
+  bool use_metadata = true;     // read versions from application.ini, snap.yaml or dpkg status instead of exec
+  bool rank_by_cost = false;    // order by `rank` and the recorded BrowserCost instead of type and version
+  RankOptions rank;
+};
+
 std::vector<BrowserInfo>     web_head_find (BrowserType type = BrowserType::Any);
+std::vector<BrowserInfo>     web_head_find (BrowserType type, const FindOptions &options);
 std::vector<BrowserInfo>     web_head_sort (const std::vector<BrowserInfo> &browsers);
+std::vector<BrowserInfo>     web_head_sort (const std::vector<BrowserInfo> &browsers, const RankOptions &rank);
+BrowserCost                  browser_cost  (const BrowserInfo &browser);
+
+enum class ProfileStore {
+  None,
+  Disk,
+  Tmpfs,
+};
+
+struct ProfilePlacement {
+  bool   tmpfs = false;         // place profiles under $XDG_RUNTIME_DIR, fall back to disk if it lacks space
+  size_t tmpfs_reserve = 256 * 1024 * 1024; // space required on tmpfs when a profile is created or claimed (not while in use), half of it caps the HTTP cache
+};
+
+class ProfilePool {
+public:
+  explicit      ProfilePool  (size_t count = 2, const ProfilePlacement &placement = ProfilePlacement());
+  /*dtor*/     ~ProfilePool  ();
+  void          prepare      (const BrowserInfo &browser, const std::string &appname = "");
+  size_t        ready        (const BrowserInfo &browser, const std::string &appname = "");
+  std::string   claim        (const BrowserInfo &browser, const std::string &appname = "");
+  struct Impl;
+private:
+  std::shared_ptr<Impl> impl_;
+};
+using ProfilePoolP = std::shared_ptr<ProfilePool>;
+
+struct GcOptions {
+  size_t max_bytes = 0;         // stop a pass after removing this many bytes, 0 = unlimited
+  int    max_ms = 0;            // stop a pass after this many milliseconds, 0 = unlimited
+  bool   idle_io = true;        // run gc_async() with idle IO priority
+};
+struct GcStats {
+  size_t dirs = 0, files = 0, bytes = 0;
+  bool   complete = true;       // false if the budget was exhausted
+};
+GcStats gc       (const GcOptions &options = GcOptions());
+void    gc_async (const GcOptions &options = GcOptions());
+
+enum class SessionPhase {
+  Start,
+  Discovery,
+  Tempdir,
+  Profile,
+  Spawn,
+  FirstLog,
+  FirstRequest,
+  Exit,
+};
+
+struct SessionStats {
+  // CLOCK_MONOTONIC timestamps in µs, 0 if the phase was not reached
+  uint64_t start = 0;           // Session::start() called
+  uint64_t discovery_begin = 0, discovery_end = 0; // last web_head_find() call
+  uint64_t tempdir = 0;         // profile directory created (or claimed from a ProfilePool)
+  uint64_t profile = 0;         // profile files written
+  uint64_t spawn = 0;           // browser process spawned
+  uint64_t first_log = 0;       // first output of the browser
+  uint64_t first_request = 0;   // see Session::mark_first_request()
+  uint64_t exit = 0;            // browser process exited
+  int      exit_code = -1;      // exit status, or 128 + signal
+};
+
+struct ResourceLimits {
+  size_t memory_high = 0;       // bytes, reclaim is throttled above, 0 = unlimited
+  size_t memory_max = 0;        // bytes, the web head is OOM killed above, 0 = unlimited
+  int    cpu_weight = 0;        // 1..10000, relative to 100 for other processes, 0 = unchanged
+  int    io_weight = 0;         // 1..10000, relative to 100 for other processes, 0 = unchanged
+  int    renderer_processes = 0; // Chromium --renderer-process-limit, Firefox dom.ipc.processCount, 0 = derived from memory_max
+  size_t js_heap_max = 0;       // bytes, Chromium V8 --max-old-space-size, 0 = derived from memory_max
+  bool   cgroup = true;         // use a cgroup v2 below our own delegated cgroup, else nice, ioprio and RLIMIT_DATA per process
+  bool   cgroup_move_host = false; // move the host process into an "app" leaf cgroup, so controllers can be enabled for web heads
+};
+
+struct SampleOptions {
+  bool pss = false;             // read PSS from smaps_rollup, costs more than RSS from /proc/<pid>/stat
+  bool breakdown = false;       // fill in ResourceSample::breakdown
+  int  interval_ms = 1000;      // for Session::start_sampling()
+};
+
+struct ProcessSample {
+  int         pid = 0;
+  std::string name;             // command name
+  std::string role;             // Chromium helper --type=, e.g. "renderer", "gpu-process"
+  size_t      rss = 0, pss = 0; // bytes, pss is 0 unless requested
+  uint64_t    cpu_us = 0;       // user + system time
+  size_t      threads = 0;
+};
+
+struct ResourceSample {
+  uint64_t    stamp = 0;        // CLOCK_MONOTONIC µs
+  size_t      rss = 0, pss = 0; // sums over the process tree
+  uint64_t    cpu_us = 0;
+  size_t      threads = 0, processes = 0;
+  std::vector<ProcessSample> breakdown;
+};
+
+enum class LogSeverity {
+  Verbose,
+  Info,
+  Warning,
+  Error,
+  Fatal,
+};
+
+struct LogLine {
+  uint64_t    stamp = 0;        // CLOCK_MONOTONIC µs
+  LogSeverity severity = LogSeverity::Info; // guessed from Chromium, Firefox and GLib message prefixes
+  std::string text;             // without newline
+};
+
+struct LogOptions {
+  bool        capture = false;  // read browser output through a pipe into memory instead of writing WebHead.log
+  size_t      buffer_bytes = 256 * 1024; // ring buffer size, the oldest lines are dropped
+  size_t      max_line = 4096;  // longer lines are split
+  LogSeverity min_severity = LogSeverity::Info; // for on_line and persist
+  int         max_lines_per_sec = 200; // for on_line and persist, excess lines are summarized, 0 = unlimited
+  std::function<void (const LogLine&)> on_line; // called from the monitor thread
+  std::string persist;          // append lines to this file, rotated to persist.1 ... persist.N
+  size_t      persist_bytes = 1024 * 1024; // rotate beyond this size
+  int         persist_files = 2; // number of rotated files kept
+};
+
+struct BundleBlob {
+  const unsigned char *data = nullptr;
+  size_t               size = 0;        // 0 if the variant is absent
+  const char          *etag = nullptr;  // quoted, derived from the content hash
+};
+
+struct BundleFile {
+  const char *path;                     // URL path, e.g. "/index.html"
+  const char *mime;
+  BundleBlob  identity, gzip, br;       // precompressed variants, generated by webhead-bundle.py
+};
+
+struct Bundle {
+  const char       *name;
+  const BundleFile *files;
+  size_t            count;
+  const uint32_t   *seeds;              // perfect hash displacement per bucket
+  size_t            buckets;
+  static constexpr uint32_t
+  hash (std::string_view key, uint32_t seed)
+  {
+    uint32_t h = 2166136261u ^ seed;    // FNV-1a
+    for (const char c : key)
+      h = (h ^ uint8_t (c)) * 16777619u;
+    return h;
+  }
+  constexpr const BundleFile*
+  find (std::string_view path) const
+  {
+    if (!count) return nullptr;
+    const BundleFile &file = files[hash (path, seeds[hash (path, 0) % buckets]) % count];
+    return path == file.path ? &file : nullptr;
+  }
+};
+
+struct HttpServerOptions {
+  std::string docroot;                          // directory with the application frontend, "" to serve mounted bundles only
+  int         port = 0;                         // 0 picks an ephemeral port
+  size_t      cache_max_bytes = 64 * 1024 * 1024; // memory for the hot-asset cache
+  size_t      cache_file_limit = 1024 * 1024;   // larger files are served with sendfile()
+  int         revalidate_ms = 1000;             // cached files are re-checked on disk after this
+};
+
+class HttpServer {
+public:
+  explicit      HttpServer      (const HttpServerOptions &options);
+  /*dtor*/     ~HttpServer      ();
+  int           listen          ();
+  void          stop            ();
+  int           port            () const;
+  std::string   url             (const std::string &path = "/") const;
+  void          on_next_request (const std::function<void()> &hook);
+  void          mount           (const Bundle &bundle);
+  struct Impl;
+private:
+  std::shared_ptr<Impl> impl_;
+  friend class JsonIpc;
+  friend class Session;
+};
+using HttpServerP = std::shared_ptr<HttpServer>;
+
+struct JsonIpcOptions {
+  std::string path = "/jsonipc";                // WebSocket endpoint on the HttpServer
+  int         flush_interval_ms = 0;            // coalesce outgoing messages for a frame, 0 = while a write is pending
+  size_t      high_watermark = 8 * 1024 * 1024; // send() fails beyond this many queued bytes
+  size_t      low_watermark = 1024 * 1024;      // on_drain() is called once the queue shrinks below
+  size_t      max_message = 64 * 1024 * 1024;   // larger incoming messages close the connection
+};
+
+class JsonIpc {
+public:
+  struct Call {
+    int64_t          id = -1;                   // -1 for notifications
+    std::string_view method;
+    std::string_view params;                    // raw JSON
+  };
+  using Handler = std::function<void (const Call &call)>;
+  explicit      JsonIpc      (const HttpServerP &server, const JsonIpcOptions &options = JsonIpcOptions());
+  /*dtor*/     ~JsonIpc      ();
+  std::string   endpoint     () const;
+  void          on_call      (const Handler &handler);
+  void          on_binary    (const std::function<void (const void*, size_t)> &handler);
+  void          on_drain     (const std::function<void()> &handler);
+  bool          send         (std::string_view json, std::string_view key = {});
+  bool          send_binary  (const void *data, size_t size);
+  bool          reply        (int64_t id, std::string_view result_json);
+  size_t        queued       () const;
+  bool          connected    () const;
+  struct Impl;
+private:
+  std::shared_ptr<Impl> impl_;
+};
+using JsonIpcP = std::shared_ptr<JsonIpc>;
+
+class CdpPipe {
+public:
+  using Callback = std::function<void (bool ok, const std::string &json)>;
+  using EventHandler = std::function<void (const std::string &method, const std::string &params)>;
+  explicit      CdpPipe     (int writefd, int readfd);
+  /*dtor*/     ~CdpPipe     ();
+  int64_t       call        (const std::string &method, const std::string &params = "{}", const Callback &callback = nullptr, bool page = true);
+  void          navigate    (const std::string &url, const Callback &callback = nullptr);
+  void          reload      (const Callback &callback = nullptr);
+  void          evaluate    (const std::string &expression, const Callback &callback);
+  void          metrics     (const Callback &callback);
+  void          on_event    (const EventHandler &handler);
+  bool          attached    () const;
+  struct Impl;
+private:
+  std::shared_ptr<Impl> impl_;
+};
+using CdpPipeP = std::shared_ptr<CdpPipe>;
+
+class BrowserHost {
+public:
+  explicit      BrowserHost  (const std::string &appname = "", const ProfilePlacement &placement = ProfilePlacement());
+  /*dtor*/     ~BrowserHost  ();
+  bool          running      () const;
+  size_t        windows      () const;
+  std::string   profile_dir  () const;
+  CdpPipeP      cdp          () const;
+  struct Impl;
+private:
+  std::shared_ptr<Impl> impl_;
+  friend class Session;
+};
+using BrowserHostP = std::shared_ptr<BrowserHost>;
+
+struct SessionOptions {
+  ProfilePoolP profile_pool;    // claim pre-staged profile directories from this pool
+  ProfilePlacement placement;   // used if no profile_pool is given
+  bool         background_gc = true; // call gc_async() after a successful start
+  GcOptions    gc_options;
+  bool         trace = true;    // write phases to WebHead.trace next to WebHead.log
+  std::function<void (SessionPhase, const SessionStats&)> on_phase; // may be called from a monitor thread
+  std::function<void (int exit_code)> on_exit;  // called from the monitor thread once the web head exited
+  HttpServerP  http_server;     // serves relative session URLs and reports the first request
+  JsonIpcP     jsonipc;         // appends #jsonipc=<endpoint> to the session URL
+  bool         cdp_pipe = false; // Chromium: control the browser via --remote-debugging-pipe, see Session::cdp()
+  BrowserHostP browser_host;    // Chromium: open the session as window of a shared browser instead of launching a browser
+  ResourceLimits limits;        // applied if any limit is set, for BrowserHost windows by the launching session
+  LogOptions   log;             // for BrowserHost windows applied by the launching session
+  bool         code_cache = false; // seed compiled code and shader caches per app and browser version, harvest them on clean exit
+  bool         record_costs = false; // add launch time and steady-state RSS to the BrowserCost history, see RankOptions
+  int          standby_timeout_ms = 60000; // kill a web head from start_standby() that is not shown in time, 0 = never
+};
 
 class Session {
 public:
-  explicit      Session  (const std::string &url, const std::string &appname = "");
+  explicit      Session  (const std::string &url, const std::string &appname = "", const SessionOptions &options = SessionOptions());
+  explicit      Session  (const Bundle &bundle, const std::string &path = "/", const std::string &appname = "",
+                          const SessionOptions &options = SessionOptions());
   int           start    (const BrowserInfo &browser);
+  int           start_standby (const BrowserInfo &browser);
+  int           show     (const std::string &url = "");
+  std::future<int> start_async (const BrowserInfo &browser);
+  void          start_async (const BrowserInfo &browser, const std::function<void (int)> &done);
+  int           exit_fd  () const;
   bool          running  ();
   int           kill     (int signal = 1);
+  int           shutdown (int timeout_ms = 3000);
+  std::string   profile_dir   () const;
+  ProfileStore  profile_store () const;
+  std::string   cgroup        () const;
+  SessionStats  stats         () const;
+  CdpPipeP      cdp           () const;
+  ResourceSample sample        (const SampleOptions &options = SampleOptions()) const;
+  void          start_sampling (const SampleOptions &options, const std::function<void (const ResourceSample&)> &callback);
+  void          stop_sampling  ();
+  std::vector<LogLine> log_lines (LogSeverity min_severity = LogSeverity::Verbose) const;
+  void          mark_first_request ();
   struct Process;
   using ProcessP = std::shared_ptr<Process>;
 private:
   std::string    url_, app_;
+  const Bundle  *bundle_ = nullptr;
+  bool           standby_ = false;
+  SessionOptions options_;
+  std::string    profile_dir_;
+  ProfileStore   store_ = ProfileStore::None;
+  SessionStats   stats_;
   ProcessP       process_;
 };
 using WebHeadSessionP = std::shared_ptr<Session>;